@@ -2,21 +2,23 @@
 
 /*
  * cond_analysis constructor
+ * The matched data are read in place rather than copied, so mdat must be kept until
+ * the analysis has been computed.
  */
-coloc_analysis::coloc_analysis(mdata *mdat, string out, double pval1, double pval2, double pval3)
+coloc_analysis::coloc_analysis(const mdata *mdat, string out, double pval1, double pval2, double pval3)
 {
 	p1 = pval1;
 	p2 = pval2;
 	p3 = pval3;
 
-	ABF_1 = NULL;
-	ABF_2 = NULL;
 	h0 = h1 = h2 = h3 = h4 = 0.0;
-	log_abf_all = log_ABF_sum = 0.0;
+	log_abf_all = log_ABF1 = log_ABF2 = log_ABF_sum = 0.0;
 
-	matched = new mdata(*mdat);
+	matched = mdat;
+	nsnps = min(mdat->snps1.size(), mdat->snps2.size());
 	outfile = out;
-	spdlog::info("Colocalisation analysis initialised with {} SNPs.", matched->snps1.size());
+	coloc_done = false;
+	prior_grid = NULL;
 }
 
 /*
@@ -25,16 +27,17 @@ coloc_analysis::coloc_analysis(mdata *mdat, string out, double pval1, double pva
 coloc_analysis::coloc_analysis()
 {
 	matched = NULL;
+	nsnps = 0;
 	outfile = "pwcoco_coloc.out";
 	
 	p1 = 1e-4;
 	p2 = 1e-4;
 	p3 = 1e-5;
 
-	ABF_1 = NULL;
-	ABF_2 = NULL;
 	h0 = h1 = h2 = h3 = h4 = 0.0;
-	log_abf_all = log_ABF_sum = 0.0;
+	log_abf_all = log_ABF1 = log_ABF2 = log_ABF_sum = 0.0;
+	coloc_done = false;
+	prior_grid = NULL;
 }
 
 /*
@@ -42,63 +45,125 @@ coloc_analysis::coloc_analysis()
  */
 coloc_analysis::~coloc_analysis()
 {
-	delete(matched);
+}
+
+/*
+ * Approximate Bayes factor of each SNP given the squared prior SD of its effect.
+ */
+HOT_KERNEL
+void abf_kernel(const double *beta, const double *se, double sd2, size_t n, double *abf)
+{
+	for (size_t i = 0; i < n; i++) {
+		double z = beta[i] / se[i],
+			r = sd2 / (sd2 + se[i] * se[i]);
+		abf[i] = 0.5 * (log(1 - r) + (r * z * z));
+	}
+}
+
+/*
+ * Log of the summed ABFs of each dataset and of both together (log-sum-exp of l1, l2
+ * and l1 + l2): one pass for the maxima and one for the sums.
+ */
+HOT_KERNEL
+void logsum_kernel(const double *l1, const double *l2, size_t n, double *out)
+{
+	double m1 = -numeric_limits<double>::infinity(), m2 = m1, m12 = m1,
+		s1 = 0.0, s2 = 0.0, s12 = 0.0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		m1 = max(m1, l1[i]);
+		m2 = max(m2, l2[i]);
+		m12 = max(m12, l1[i] + l2[i]);
+	}
+	for (i = 0; i < n; i++) {
+		s1 += exp(l1[i] - m1);
+		s2 += exp(l2[i] - m2);
+		s12 += exp(l1[i] + l2[i] - m12);
+	}
+
+	out[0] = m1 + log(s1);
+	out[1] = m2 + log(s2);
+	out[2] = m12 + log(s12);
+}
+
+/*
+ * Posteriors of H0-H4 for every combination of priors, given the log-sums of the ABFs.
+ * Only the priors change between combinations so each costs a handful of operations.
+ */
+HOT_KERNEL
+void prior_grid_kernel(const coloc_prior *grid, size_t g, double l1, double l2, double l12, double *pp, double *abf_all)
+{
+	double l3 = logdiff(l1 + l2, l12);
+
+	for (size_t k = 0; k < g; k++) {
+		double lp1 = log(grid[k].p1), lp2 = log(grid[k].p2),
+			h[5] = { 0.0, lp1 + l1, lp2 + l2, lp1 + lp2 + l3, log(grid[k].p3) + l12 },
+			m = h[0], s = 0.0;
+		size_t j;
+
+		for (j = 1; j < 5; j++)
+			m = max(m, h[j]);
+		for (j = 0; j < 5; j++)
+			s += exp(h[j] - m);
+		abf_all[k] = m + log(s);
+		for (j = 0; j < 5; j++)
+			pp[5 * k + j] = exp(h[j] - abf_all[k]);
+	}
 }
 
 /*
  * Estimates the Bayes factor for the SNP information provided.
+ * @param double *labf Buffer for the log ABF of each SNP
  * @ret bool True if fine, false is stop
  */
-bool coloc_analysis::estimate_bf(const vector<double> beta, const vector<double> se, const vector<double> freq, 
-	const vector<double> n, coloc_type type, vector<double> *ABF)
-{
-	vector<double> invbeta, // 1/varbeta
-		nvx = freq, 
-		z = beta, 
-		varbeta = se, // se^2
-		ssize = n,
-		r, log_temp;
-	double sdY, sd_prior;
-
-	// Square standard errors and ensure frequencies are MINOR allele frequencies
-	transform(varbeta.begin(), varbeta.end(), varbeta.begin(), [](double x) { return x * x; });
-	transform(nvx.begin(), nvx.end(), nvx.begin(), [](double x) { return x > 0.5 ? 1.0 - x : x; });
-
-	if (type == coloc_type::COLOC_QUANT) {
-		// Inverse beta calculation
-		invbeta = varbeta;
-		transform(invbeta.begin(), invbeta.end(), invbeta.begin(), [](double x) { return 1 / x; });
-		// Estimate sdY from 
-		transform(nvx.begin(), nvx.end(), ssize.begin(), nvx.begin(), [](double x, double n_) { return 2 * n_ * x * (1 - x); });
-
-		// Regress n*var(x) against 1/var(beta)
-		sdY = lm_fixed(invbeta, nvx); // same as: lm(nvx ~ invbeta - 1)
+bool coloc_analysis::estimate_bf(const vector<double> &beta, const vector<double> &se, const vector<double> &freq,
+	const vector<double> &n, coloc_type type, double *labf)
+{
+	if (type == coloc_type::COLOC_QUANT)
+		return estimate_bf<coloc_type::COLOC_QUANT>(beta, se, freq, n, labf);
+	return estimate_bf<coloc_type::COLOC_CC>(beta, se, freq, n, labf);
+}
+
+/*
+ * Bayes factors for one trait type. The type is fixed at compile time so the sdY
+ * regression is only generated for quantitative traits and the per-SNP loops are
+ * free of branches.
+ */
+template <coloc_type type>
+bool coloc_analysis::estimate_bf(const vector<double> &beta, const vector<double> &se, const vector<double> &freq,
+	const vector<double> &n, double *labf)
+{
+	size_t i, size = nsnps;
+	double sd_prior;
+
+	if constexpr (type == coloc_type::COLOC_QUANT) {
+		double sumXY = 0.0, sumXX = 0.0, sdY;
+
+		// Estimate sdY by regressing n*var(x) against 1/var(beta) through the origin,
+		// same as: lm(nvx ~ invbeta - 1), using the MINOR allele frequencies
+		for (i = 0; i < size; i++) {
+			double x = freq[i] > 0.5 ? 1.0 - freq[i] : freq[i],
+				invbeta = 1 / (se[i] * se[i]),
+				nvx = 2 * n[i] * x * (1 - x);
+			sumXY += invbeta * nvx;
+			sumXX += invbeta * invbeta;
+		}
+
+		sdY = sumXY / sumXX;
 		if (sdY < 0) {
 			spdlog::critical("sdY estimation is negative (sdY = {:.2f}) which may be caused by small datasets or those with errors. Cannot continue with colocalisation analysis.", sdY);
 			return false;
 		}
 		sdY = sqrt(sdY);
-	}
-
-	if (type == coloc_type::COLOC_QUANT) {
 		sd_prior = 0.15 * sdY;
 	}
 	else {
 		sd_prior = 0.2;
 	}
 
-	// Calculate z and estimate Bayes factors
-	transform(z.begin(), z.end(), se.begin(), z.begin(), [](double b, double se_) { return b / se_; });
-	
-	r = varbeta;
-	transform(r.begin(), r.end(), r.begin(), [sd_prior](double v) { return (sd_prior * sd_prior) / (sd_prior * sd_prior + v); });
-
-	// Caluclate approximate Bayes factor
-	size_t i, size = varbeta.size();
-	//ABF->resize(size);
-	for (i = 0; i < size; i++) {
-		ABF->push_back(0.5 * (log(1 - r[i]) + (r[i] * z[i] * z[i])));
-	}
+	// Calculate z and estimate approximate Bayes factors
+	abf_kernel(beta.data(), se.data(), sd_prior * sd_prior, size, labf);
 	return true;
 }
 
@@ -107,11 +172,8 @@ bool coloc_analysis::estimate_bf(const vector<double> beta, const vector<double>
  * l1 = lABF1, l2 = lABF2
  * p1 = 1e-4, p2 = 1e-4, p12 = 1e-5
  */
-void coloc_analysis::combine_abf(size_t abf_size)
+void coloc_analysis::combine_abf()
 {
-	double log_ABF1 = logsum(*ABF_1),
-		log_ABF2 = logsum(*ABF_2);
-
 	h0 = 0.0;
 	h1 = log(p1) + log_ABF1;
 	h2 = log(p2) + log_ABF2;
@@ -130,7 +192,8 @@ void coloc_analysis::combine_abf(size_t abf_size)
  */
 void coloc_analysis::init_coloc(string exp, string out)
 {
-	if (matched->snps1.size() <= 0 || matched->snps2.size() <= 0) {
+	spdlog::info("Colocalisation analysis initialised with {} SNPs.", nsnps);
+	if (nsnps == 0) {
 		spdlog::warn("Could not conduct colocalisation analysis for {} and {} as no SNPs were included in the analysis.", exp, out);
 		return;
 	}
@@ -139,6 +202,7 @@ void coloc_analysis::init_coloc(string exp, string out)
 	spdlog::info("Unconditioned colocalisation results.");
 	spdlog::info("H0: {:.2f}; H1: {:.2f}; H2: {:.2f}; H3: {:.2f}; H4: {:.2f}; abf_all: {:.2f}.", pp_abf[H0], pp_abf[H1], pp_abf[H2], pp_abf[H3], pp_abf[H4], log_abf_all);
 	results_to_file("unconditioned", "unconditioned", exp ,out);
+	grid_to_file("unconditioned", "unconditioned", exp, out);
 }
 
 /*
@@ -147,16 +211,39 @@ void coloc_analysis::init_coloc(string exp, string out)
  */
 void coloc_analysis::init_coloc(string snp1, string snp2, string exp, string out)
 {
-	if (matched->snps1.size() <= 0 || matched->snps2.size() <= 0) {
+	compute_coloc();
+	report_coloc(snp1, snp2, exp, out);
+}
+
+/*
+ * Runs the colocalisation analysis on the conditioned data without logging results or
+ * writing them out, so that independent analyses can run on separate threads.
+ * @ret bool True if the results are ready to report
+ */
+bool coloc_analysis::compute_coloc()
+{
+	coloc_done = nsnps > 0 && perform_coloc();
+	return coloc_done;
+}
+
+/*
+ * Logs and saves the results from compute_coloc.
+ * @ret void
+ */
+void coloc_analysis::report_coloc(string snp1, string snp2, string exp, string out)
+{
+	spdlog::info("Colocalisation analysis initialised with {} SNPs.", nsnps);
+	if (nsnps == 0) {
 		spdlog::warn("Could not conduct colocalisation analysis for {} and {} as no SNPs were included in the analysis.", exp, out);
 		return;
 	}
 
-	if (perform_coloc() == false)
+	if (coloc_done == false)
 		return;
 	spdlog::info("Conditioned results for SNP1: {}, SNP2: {}", snp1, snp2);
 	spdlog::info("H0: {:.2f}; H1: {:.2f}; H2: {:.2f}; H3: {:.2f}; H4: {:.2f}; abf_all: {:.2f}.", pp_abf[H0], pp_abf[H1], pp_abf[H2], pp_abf[H3], pp_abf[H4], log_abf_all);
 	results_to_file(snp1, snp2, exp ,out);
+	grid_to_file(snp1, snp2, exp, out);
 }
 
 /*
@@ -165,36 +252,42 @@ void coloc_analysis::init_coloc(string snp1, string snp2, string exp, string out
  */
 bool coloc_analysis::perform_coloc()
 {
-	vector<double> temp, temp2;
-	// Estimate sdY and then Bayes factor for the two datasets
-	// First the conditional analysis dataset
-	if (estimate_bf(matched->betas1, matched->ses1, matched->mafs1, matched->ns1, matched->type1, &temp) == false)
-		return false;
-	ABF_1 = &temp;
+	double log_sums[3];
 
-	// Now the outcome phenotype dataset
-	if (estimate_bf(matched->betas2, matched->ses2, matched->mafs2, matched->ns2, matched->type2, &temp2) == false)
+	// Estimate sdY and then Bayes factor for the two datasets, straight from the matched columns
+	labf.resize(2 * nsnps);
+	if (estimate_bf(matched->betas1, matched->ses1, matched->mafs1, matched->ns1, matched->type1, labf.data()) == false)
+		return false;
+	if (estimate_bf(matched->betas2, matched->ses2, matched->mafs2, matched->ns2, matched->type2, labf.data() + nsnps) == false)
 		return false;
-	ABF_2 = &temp2;
-
-	// "Merge" ABFs for SNPs in both datasets and sum
-	size_t i, n = ABF_1->size();
-	for (i = 0; i < n; i++) {
-		ABF_sum.push_back(ABF_1->at(i) + ABF_2->at(i));
-	}
-	log_ABF_sum = logsum(ABF_sum);
 
-	// Likely unnecessary - but this is posterior probability of each SNP's H4
-	vector<double> pp_h4(n);
-	for (i = 0; i < n; i++) {
-		pp_h4[i] = exp(ABF_sum[i] - log_ABF_sum);
-	}
+	// Sum the ABFs of each dataset and of the SNPs in both
+	logsum_kernel(labf.data(), labf.data() + nsnps, nsnps, log_sums);
+	log_ABF1 = log_sums[0];
+	log_ABF2 = log_sums[1];
+	log_ABF_sum = log_sums[2];
 
 	// Combine the PPs to find each H
-	combine_abf(ABF_sum.size());
+	combine_abf();
+
+	// The same log-sums give the posteriors under every other prior
+	if (prior_grid && !prior_grid->empty()) {
+		grid_pp.resize(5 * prior_grid->size());
+		grid_abf_all.resize(prior_grid->size());
+		prior_grid_kernel(prior_grid->data(), prior_grid->size(), log_ABF1, log_ABF2, log_ABF_sum, grid_pp.data(), grid_abf_all.data());
+	}
 	return true;
 }
 
+/*
+ * Also evaluate the posteriors for each of these priors; grid must outlive the analysis.
+ * @ret void
+ */
+void coloc_analysis::set_prior_grid(const vector<coloc_prior> *grid)
+{
+	prior_grid = grid;
+}
+
 /*
  * Saves colocalisation results to file.
  * @ret void
@@ -218,3 +311,34 @@ void coloc_analysis::results_to_file(string s1, string s2, string exp, string ou
 	file << exp << "\t" << out << "\t" << s1 << "\t" << s2 << "\t" << num_snps() << "\t" << pp_abf[H0] << "\t" << pp_abf[H1] << "\t" << pp_abf[H2] << "\t" << pp_abf[H3] << "\t" << pp_abf[H4] << "\t" << log_abf_all << endl;
 	file.close();
 }
+
+/*
+ * Saves the posteriors for each prior of the --coloc_pp_grid to the companion file.
+ * @ret void
+ */
+void coloc_analysis::grid_to_file(string s1, string s2, string exp, string out)
+{
+	if (!prior_grid || prior_grid->empty() || grid_abf_all.size() != prior_grid->size())
+		return;
+
+	ifstream ifile(outfile + ".coloc_grid");
+	bool write_header = file_is_empty(ifile);
+	ofstream file;
+
+	ifile.close();
+	file.open(outfile + ".coloc_grid", std::ios::out | std::ios::app);
+	if (file.fail()) {
+		spdlog::warn("Could not write colocalisation results to file {}. Please check permissions for this folder.", outfile + ".coloc_grid");
+		return;
+	}
+
+	if (write_header) {
+		file << "Dataset1\tDataset2\tSNP1\tSNP2\tnsnps\tp1\tp2\tp12\tH0\tH1\tH2\tH3\tH4\tlog_abf_all" << endl;
+	}
+	for (size_t k = 0; k < prior_grid->size(); k++) {
+		const double *pp = &grid_pp[5 * k];
+		file << exp << "\t" << out << "\t" << s1 << "\t" << s2 << "\t" << num_snps() << "\t" << (*prior_grid)[k].p1 << "\t" << (*prior_grid)[k].p2 << "\t" << (*prior_grid)[k].p3
+			<< "\t" << pp[H0] << "\t" << pp[H1] << "\t" << pp[H2] << "\t" << pp[H3] << "\t" << pp[H4] << "\t" << grid_abf_all[k] << "\n";
+	}
+	file.close();
+}
@@ -14,28 +14,50 @@ enum hypothesis {
 	H4,
 };
 
+// One combination of the three coloc priors, for --coloc_pp_grid
+struct coloc_prior {
+	double p1, p2, p3;
+};
+
+// Bayes factor kernels, also used by the --coloc_only screen
+void abf_kernel(const double *beta, const double *se, double sd2, size_t n, double *abf);
+void logsum_kernel(const double *l1, const double *l2, size_t n, double *out);
+void prior_grid_kernel(const coloc_prior *grid, size_t g, double l1, double l2, double l12, double *pp, double *abf_all);
+
 class coloc_analysis {
 public:
-	coloc_analysis(mdata *mdat, string out, double pval1, double pval2, double pval3);
+	coloc_analysis(const mdata *mdat, string out, double pval1, double pval2, double pval3);
 	coloc_analysis();
 	~coloc_analysis();
 
 	void init_coloc(string exp, string out);
 	void init_coloc(string snp1, string snp2, string exp, string out);
+	bool compute_coloc();
+	void report_coloc(string snp1, string snp2, string exp, string out);
+	void set_prior_grid(const vector<coloc_prior> *grid);
 
 	vector<double> pp_abf; // Results from colocalisation
 
 	size_t num_snps() {
-		return matched->snps1.size();
+		return nsnps;
+	}
+
+	// Per-SNP log ABFs of dataset 1 followed by those of dataset 2, once computed
+	const double *log_abfs() {
+		return labf.data();
 	}
 	
 private:
 	bool perform_coloc();
-	bool estimate_bf(const vector<double> beta, const vector<double> se, const vector<double> freq, const vector<double> n, coloc_type type, vector<double> *ABF);
-	void combine_abf(size_t abf_size);
+	bool estimate_bf(const vector<double> &beta, const vector<double> &se, const vector<double> &freq, const vector<double> &n, coloc_type type, double *labf);
+	template <coloc_type type>
+	bool estimate_bf(const vector<double> &beta, const vector<double> &se, const vector<double> &freq, const vector<double> &n, double *labf);
+	void combine_abf();
 	void results_to_file(string s1, string s2, string exp, string out);
+	void grid_to_file(string s1, string s2, string exp, string out);
 
-	mdata *matched;
+	const mdata *matched; // Not owned; only read until the analysis has been computed
+	size_t nsnps; // Number of matched SNPs
 	string outfile;
 
 	// Coloc stuff
@@ -44,9 +66,13 @@ private:
 	double p3; // Prior probability of SNP associated with both traits
 	map<size_t, size_t> snp_map; // 1st refers to snps1, 2nd refers to snps2
 
-	vector<double> *ABF_1, *ABF_2;
-	vector<double> ABF_sum;
+	vector<double> labf; // Per-SNP log ABFs of dataset 1 followed by those of dataset 2
 	double h0, h1, h2, h3, h4;
-	double log_ABF_sum;
+	double log_ABF1, log_ABF2, log_ABF_sum; // Log-sums of the ABFs of each dataset and of both together
 	double log_abf_all;
+	bool coloc_done; // compute_coloc finished and the results can be reported
+
+	const vector<coloc_prior> *prior_grid; // Extra priors to evaluate; not owned, NULL if none
+	vector<double> grid_pp; // H0-H4 for each prior in the grid
+	vector<double> grid_abf_all; // log_abf_all for each prior in the grid
 };
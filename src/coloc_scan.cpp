@@ -0,0 +1,199 @@
+#include "coloc_scan.h"
+
+const logsum_window::lse3 logsum_window::empty = { { { -numeric_limits<double>::infinity(), 0.0 }, { -numeric_limits<double>::infinity(), 0.0 }, { -numeric_limits<double>::infinity(), 0.0 } } };
+
+logsum_window::logsum_window()
+{
+	clear();
+}
+
+logsum_window::lse logsum_window::combine(const lse &a, const lse &b)
+{
+	if (a.s == 0.0)
+		return b;
+	if (b.s == 0.0)
+		return a;
+	if (a.m >= b.m)
+		return { a.m, a.s + b.s * exp(b.m - a.m) };
+	return { b.m, b.s + a.s * exp(a.m - b.m) };
+}
+
+logsum_window::lse3 logsum_window::combine(const lse3 &a, const lse3 &b)
+{
+	return { combine(a[0], b[0]), combine(a[1], b[1]), combine(a[2], b[2]) };
+}
+
+logsum_window::lse3 logsum_window::single(double l1, double l2)
+{
+	return { { { l1, 1.0 }, { l2, 1.0 }, { l1 + l2, 1.0 } } };
+}
+
+/*
+ * Adds the next SNP to the window.
+ */
+void logsum_window::push(double l1, double l2)
+{
+	back.push_back({ l1, l2 });
+	back_sum = combine(back_sum, single(l1, l2));
+}
+
+/*
+ * Removes the oldest SNP from the window. When the front stack is empty the SNPs added
+ * since are moved onto it, newest first, so each SNP is moved once.
+ */
+void logsum_window::pop()
+{
+	if (front.empty()) {
+		lse3 acc = empty;
+
+		for (size_t k = back.size(); k-- > 0;) {
+			acc = combine(single(back[k][0], back[k][1]), acc);
+			front.push_back(acc);
+		}
+		back.clear();
+		back_sum = empty;
+	}
+	if (!front.empty())
+		front.pop_back();
+}
+
+/*
+ * Log-sums over the window in the order of logsum_kernel: ABF_1, ABF_2 and ABF_1 + ABF_2.
+ */
+void logsum_window::sums(double *out) const
+{
+	lse3 total = combine(front.empty() ? empty : front.back(), back_sum);
+
+	for (int c = 0; c < 3; c++)
+		out[c] = total[c].s > 0.0 ? total[c].m + log(total[c].s) : -numeric_limits<double>::infinity();
+}
+
+void logsum_window::clear()
+{
+	back.clear();
+	front.clear();
+	back_sum = empty;
+}
+
+coloc_scan::coloc_scan(string out, double p1, double p2, double p3, int window, int step)
+{
+	outfile = out;
+	prior = { p1, p2, p3 };
+	this->window = window;
+	this->step = step;
+}
+
+/*
+ * Scans the exposure and outcome for colocalisation in windows along the genome.
+ * @param reference *ref Reference holding the SNP positions (.bim or LD matrix)
+ * @ret bool True if the scan was written out
+ */
+bool coloc_scan::run(phenotype *exposure, phenotype *outcome, reference *ref)
+{
+	string exp_name = exposure->get_phenoname(), out_name = outcome->get_phenoname();
+	unordered_map<string, size_t> bim_map;
+	vector<scan_snp> snps;
+	size_t i, windows = 0;
+
+	mdata *matched = new mdata(exposure, outcome);
+	coloc_analysis *genome = new coloc_analysis(matched, outfile, prior.p1, prior.p2, prior.p3);
+	size_t n = genome->num_snps();
+
+	if (!genome->compute_coloc()) {
+		spdlog::critical("Colocalisation scan could not compute the Bayes factors of {} and {}.", exp_name, out_name);
+		delete(genome);
+		delete(matched);
+		return false;
+	}
+
+	// Place the matched SNPs with the reference positions
+	bim_map.reserve(ref->bim_snp_name.size());
+	for (i = 0; i < ref->bim_snp_name.size(); i++)
+		bim_map.emplace(ref->bim_snp_name[i], i);
+
+	snps.reserve(n);
+	for (i = 0; i < n; i++) {
+		auto iter = bim_map.find(matched->snps1[i]);
+		if (iter == bim_map.end())
+			continue;
+		snps.push_back({ ref->bim_chr[iter->second], ref->bim_bp[iter->second], i });
+	}
+	stable_sort(snps.begin(), snps.end(), [](const scan_snp &a, const scan_snp &b) {
+		return a.chr != b.chr ? a.chr < b.chr : a.bp < b.bp;
+	});
+	spdlog::info("Scanning {} of the {} SNPs matched between {} and {} in windows of {} bp every {} bp.", snps.size(), n, exp_name, out_name, window, step);
+
+	ifstream ifile(outfile + ".coloc_scan");
+	bool write_header = file_is_empty(ifile);
+	ofstream file;
+
+	ifile.close();
+	file.open(outfile + ".coloc_scan", std::ios::out | std::ios::app);
+	if (file.fail()) {
+		spdlog::critical("Could not write colocalisation results to file {}. Please check permissions for this folder.", outfile + ".coloc_scan");
+		delete(genome);
+		delete(matched);
+		return false;
+	}
+	if (write_header)
+		file << "Dataset1\tDataset2\tCHR\tBP_start\tBP_end\tnsnps\tH0\tH1\tH2\tH3\tH4\tlog_abf_all" << endl;
+
+	for (size_t a = 0, b; a < snps.size(); a = b) {
+		for (b = a + 1; b < snps.size() && snps[b].chr == snps[a].chr; b++);
+		windows += scan_chromosome(snps, a, b, genome->log_abfs(), genome->log_abfs() + n, exp_name, out_name, file);
+	}
+	file.close();
+
+	spdlog::info("Colocalisation scan wrote {} windows to {}.", windows, outfile + ".coloc_scan");
+	delete(genome);
+	delete(matched);
+	return true;
+}
+
+/*
+ * Sweeps one chromosome, snps[a, b), with the windows [start, start + window) where start
+ * runs over multiples of the step. The two ends of the window only move forward, so each
+ * SNP enters and leaves the log-sums once; windows without SNPs are skipped.
+ * @ret size_t Number of windows written
+ */
+size_t coloc_scan::scan_chromosome(const vector<scan_snp> &snps, size_t a, size_t b, const double *l1, const double *l2,
+	const string &exp, const string &out, ofstream &file)
+{
+	logsum_window sums;
+	size_t lo = a, hi = a, written = 0;
+	long long start = ((long long)snps[a].bp / step) * step, end;
+	double log_sums[3], pp[6];
+
+	while (lo < b) {
+		end = start + window;
+		while (hi < b && snps[hi].bp < end) {
+			sums.push(l1[snps[hi].idx], l2[snps[hi].idx]);
+			hi++;
+		}
+		while (lo < hi && snps[lo].bp < start) {
+			sums.pop();
+			lo++;
+		}
+
+		if (lo == hi) {
+			// Empty window: move to the first window that reaches the next SNP
+			if (hi == b)
+				break;
+			long long next = snps[hi].bp - window + 1;
+			start = next <= start ? start + step : ((next + step - 1) / step) * step;
+			continue;
+		}
+
+		sums.sums(log_sums);
+		prior_grid_kernel(&prior, 1, log_sums[0], log_sums[1], log_sums[2], pp, pp + 5);
+		file << exp << "\t" << out << "\t" << snps[a].chr << "\t" << start << "\t" << end - 1 << "\t" << hi - lo << "\t"
+			<< pp[H0] << "\t" << pp[H1] << "\t" << pp[H2] << "\t" << pp[H3] << "\t" << pp[H4] << "\t" << pp[5] << "\n";
+		written++;
+
+		if (hi == b)
+			break; // This window reached the last SNP of the chromosome
+		start += step;
+	}
+
+	return written;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "data.h"
+#include "coloc.h"
+#include "helper_funcs.h"
+
+using namespace std;
+
+/*
+ * Log-sums of the ABFs of both datasets, and of their sum, over a sliding window of SNPs.
+ * The window is a two-stack queue of (max, scaled sum) pairs, so each SNP is added and
+ * removed once at O(1) amortised cost and nothing is ever subtracted: the sums stay as
+ * accurate as a full logsum however long the scan runs.
+ */
+class logsum_window {
+public:
+	logsum_window();
+
+	void push(double l1, double l2);
+	void pop();
+	void sums(double *out) const;
+	void clear();
+
+private:
+	struct lse {
+		double m, s; // Sum is exp(m) * s
+	};
+	typedef array<lse, 3> lse3;
+
+	static lse combine(const lse &a, const lse &b);
+	static lse3 combine(const lse3 &a, const lse3 &b);
+	static lse3 single(double l1, double l2);
+
+	vector<array<double, 2>> back; /// ABFs added since the last flip, oldest first
+	lse3 back_sum; /// Sum over back
+	vector<lse3> front; /// Sums over the older SNPs from each to the newest of them; the oldest is on top
+	static const lse3 empty;
+};
+
+/*
+ * Genome-wide sliding-window colocalisation (--coloc_scan).
+ *
+ * The matched SNPs are placed with the .bim (or LD matrix) positions and swept once per
+ * chromosome, with windows of a fixed width in bp starting every step bp. Per-SNP Bayes
+ * factors are computed once for the whole genome, so for a quantitative trait sdY is
+ * estimated from all matched SNPs rather than from each window.
+ */
+class coloc_scan {
+public:
+	coloc_scan(string out, double p1, double p2, double p3, int window, int step);
+
+	bool run(phenotype *exposure, phenotype *outcome, reference *ref);
+
+private:
+	struct scan_snp {
+		unsigned short chr;
+		int bp;
+		size_t idx; /// Position in the matched data
+	};
+
+	size_t scan_chromosome(const vector<scan_snp> &snps, size_t a, size_t b, const double *l1, const double *l2,
+		const string &exp, const string &out, ofstream &file);
+
+	string outfile;
+	coloc_prior prior;
+	int window; /// Width of each window in bp
+	int step; /// Distance in bp between the starts of consecutive windows
+};
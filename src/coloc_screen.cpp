@@ -0,0 +1,265 @@
+#include "coloc_screen.h"
+
+coloc_screen::coloc_screen(string out, double p1, double p2, double p3, const vector<coloc_prior> &grid)
+{
+	outfile = out;
+	prior = { p1, p2, p3 };
+	prior_grid = grid;
+}
+
+/*
+ * Reads the summary statistics at path, either one file or every file in a folder.
+ * Files are read in parallel in batches and added to the shared SNP index in order.
+ * @param string path File or folder of summary statistics
+ * @param bool exposure Whether these are exposures (dataset 1) or outcomes (dataset 2)
+ * @ret int Number of datasets that were read
+ */
+int coloc_screen::add_datasets(const string &path, bool exposure, double n, double n_case, double pve, const string &pve_file)
+{
+	vector<fs::path> files;
+	const size_t batch = 64;
+	int added = 0;
+
+	if (fs::is_directory(path)) {
+		for (const auto &entry : fs::recursive_directory_iterator(path))
+			if (entry.is_regular_file())
+				files.push_back(entry.path());
+		sort(files.begin(), files.end());
+	}
+	else {
+		files.push_back(path);
+	}
+
+	for (size_t start = 0; start < files.size(); start += batch) {
+		size_t end = min(files.size(), start + batch);
+		vector<phenotype *> phenos(end - start, nullptr);
+
+#pragma omp parallel for schedule(dynamic)
+		for (int k = 0; k < (int)(end - start); k++)
+			phenos[k] = init_pheno(files[start + k].string(), files[start + k].filename().string(), n, n_case, pve, pve_file);
+
+		for (phenotype *pheno : phenos) {
+			if (pheno->has_failed()) {
+				spdlog::error("Reading of summary statistics {} has failed, it will be left out of the screen.", pheno->get_phenoname());
+			}
+			else {
+				add_dataset(pheno, exposure);
+				added++;
+			}
+			delete pheno;
+		}
+	}
+
+	spdlog::info("Read {} {} for the colocalisation screen from {}.", added, exposure ? "exposures" : "outcomes", path);
+	return added;
+}
+
+/*
+ * Moves the columns of a phenotype into a dataset over the shared SNP index.
+ * SNPs are screened with the same checks as mdata, and the Bayes factors of a
+ * case-control trait are computed here as they are the same for every pair.
+ * @ret void
+ */
+void coloc_screen::add_dataset(phenotype *pheno, bool exposure)
+{
+	dataset d;
+	size_t i, m = pheno->snp_name.size();
+
+	d.name = pheno->get_phenoname();
+	d.type = pheno->get_coloc_type();
+	d.snp.resize(m);
+	d.usable.resize(m);
+	for (i = 0; i < m; i++) {
+		auto iter = snp_index.emplace(pheno->snp_name[i], (uint32_t)snp_index.size()).first;
+		d.snp[i] = iter->second;
+		d.usable[i] = pheno->beta[i] != 0.0 && isfinite(pheno->beta[i]) && isfinite(pheno->se[i]);
+	}
+	d.beta.swap(pheno->beta);
+	d.se.swap(pheno->se);
+
+	if (d.type == coloc_type::COLOC_QUANT) {
+		d.maf.swap(pheno->freq);
+		d.n.swap(pheno->n);
+	}
+	else {
+		d.labf.resize(m);
+		abf_kernel(d.beta.data(), d.se.data(), 0.2 * 0.2, m, d.labf.data());
+	}
+
+	if (exposure)
+		exposures.push_back(std::move(d));
+	else
+		outcomes.push_back(std::move(d));
+}
+
+/*
+ * Log ABFs of the matched rows of a dataset. For a quantitative trait the prior on the
+ * effect size comes from sdY, estimated over the matched SNPs as in coloc_analysis::estimate_bf.
+ * @ret bool False if sdY could not be estimated
+ */
+bool coloc_screen::pair_labf(const dataset &d, const vector<uint32_t> &rows, pair_buffers &buf, vector<double> &labf)
+{
+	size_t i, m = rows.size();
+	double sumXY = 0.0, sumXX = 0.0, sdY, sd_prior;
+
+	labf.resize(m);
+	if (d.type != coloc_type::COLOC_QUANT) {
+		for (i = 0; i < m; i++)
+			labf[i] = d.labf[rows[i]];
+		return true;
+	}
+
+	buf.beta.resize(m);
+	buf.se.resize(m);
+	for (i = 0; i < m; i++) {
+		size_t r = rows[i];
+		double x = d.maf[r] > 0.5 ? 1.0 - d.maf[r] : d.maf[r],
+			invbeta = 1 / (d.se[r] * d.se[r]),
+			nvx = 2 * d.n[r] * x * (1 - x);
+		sumXY += invbeta * nvx;
+		sumXX += invbeta * invbeta;
+		buf.beta[i] = d.beta[r];
+		buf.se[i] = d.se[r];
+	}
+
+	sdY = sumXY / sumXX;
+	if (sdY < 0)
+		return false;
+	sd_prior = 0.15 * sqrt(sdY);
+
+	abf_kernel(buf.beta.data(), buf.se.data(), sd_prior * sd_prior, m, labf.data());
+	return true;
+}
+
+/*
+ * Colocalises exposure d1 with outcome d2.
+ * SNPs are matched in the order of d1 against the first row of each SNP in d2, given by
+ * pos2 (-1 if the SNP is not in d2 or that row cannot be used), as mdata does.
+ * @param double *pp Posteriors H0-H4 and log_abf_all for the --coloc_pp prior
+ * @param double *grid_pp Posteriors then log_abf_all for each prior of the grid
+ * @ret size_t Number of SNPs used, 0 if the pair could not be colocalised
+ */
+size_t coloc_screen::coloc_pair(const dataset &d1, const dataset &d2, const vector<int32_t> &pos2, pair_buffers &buf, double *pp, double *grid_pp)
+{
+	size_t i, m, g = prior_grid.size();
+	double log_sums[3];
+
+	buf.rows1.clear();
+	buf.rows2.clear();
+	for (i = 0; i < d1.snp.size(); i++) {
+		int32_t j = pos2[d1.snp[i]];
+		if (j < 0 || !d1.usable[i])
+			continue;
+		buf.rows1.push_back((uint32_t)i);
+		buf.rows2.push_back((uint32_t)j);
+	}
+
+	m = buf.rows1.size();
+	if (m == 0 || !pair_labf(d1, buf.rows1, buf, buf.l1) || !pair_labf(d2, buf.rows2, buf, buf.l2))
+		return 0;
+
+	logsum_kernel(buf.l1.data(), buf.l2.data(), m, log_sums);
+	prior_grid_kernel(&prior, 1, log_sums[0], log_sums[1], log_sums[2], pp, pp + 5);
+	if (g > 0)
+		prior_grid_kernel(prior_grid.data(), g, log_sums[0], log_sums[1], log_sums[2], grid_pp, grid_pp + 5 * g);
+	return m;
+}
+
+/*
+ * Colocalises every exposure against every outcome, one outcome at a time.
+ * Results are appended to the .coloc (and .coloc_grid) files in the same format as
+ * the initial colocalisation of a pair.
+ * @ret void
+ */
+void coloc_screen::run()
+{
+	size_t n1 = exposures.size(), g = prior_grid.size(), pairs = 0, skipped = 0;
+	vector<int32_t> pos2(snp_index.size(), -1);
+	vector<size_t> nsnps(n1);
+	vector<double> pp(6 * n1), grid_pp(6 * g * n1);
+	ofstream file, grid_file;
+	bool write_header;
+
+	spdlog::info("Colocalising {} exposures against {} outcomes over {} distinct SNPs.", n1, outcomes.size(), snp_index.size());
+
+	ifstream ifile(outfile + ".coloc");
+	write_header = file_is_empty(ifile);
+	ifile.close();
+	file.open(outfile + ".coloc", std::ios::out | std::ios::app);
+	if (file.fail()) {
+		spdlog::critical("Could not write colocalisation results to file {}. Please check permissions for this folder.", outfile + ".coloc");
+		return;
+	}
+	if (write_header)
+		file << "Dataset1\tDataset2\tSNP1\tSNP2\tnsnps\tH0\tH1\tH2\tH3\tH4\tlog_abf_all" << endl;
+
+	if (g > 0) {
+		ifstream igfile(outfile + ".coloc_grid");
+		write_header = file_is_empty(igfile);
+		igfile.close();
+		grid_file.open(outfile + ".coloc_grid", std::ios::out | std::ios::app);
+		if (grid_file.fail()) {
+			spdlog::critical("Could not write colocalisation results to file {}. Please check permissions for this folder.", outfile + ".coloc_grid");
+			return;
+		}
+		if (write_header)
+			grid_file << "Dataset1\tDataset2\tSNP1\tSNP2\tnsnps\tp1\tp2\tp12\tH0\tH1\tH2\tH3\tH4\tlog_abf_all" << endl;
+	}
+
+	for (const dataset &d2 : outcomes) {
+		size_t j;
+
+		// -2 marks a SNP whose first row in the outcome cannot be used
+		for (j = 0; j < d2.snp.size(); j++)
+			if (pos2[d2.snp[j]] == -1)
+				pos2[d2.snp[j]] = d2.usable[j] ? (int32_t)j : -2;
+
+#pragma omp parallel
+		{
+			pair_buffers buf;
+
+#pragma omp for schedule(dynamic, 16)
+			for (int i = 0; i < (int)n1; i++)
+				nsnps[i] = coloc_pair(exposures[i], d2, pos2, buf, &pp[6 * i], g > 0 ? &grid_pp[6 * g * i] : nullptr);
+		}
+
+		write_results(d2, nsnps, pp, grid_pp, file, grid_file);
+		for (j = 0; j < d2.snp.size(); j++)
+			pos2[d2.snp[j]] = -1;
+
+		for (j = 0; j < n1; j++) {
+			if (nsnps[j] > 0)
+				pairs++;
+			else
+				skipped++;
+		}
+	}
+
+	file.close();
+	if (g > 0)
+		grid_file.close();
+	spdlog::info("Colocalised {} pairs; {} pairs were skipped as they had no usable SNPs in common or sdY could not be estimated.", pairs, skipped);
+}
+
+/*
+ * Writes the results of every exposure against outcome d2, skipping pairs that were not colocalised.
+ * @ret void
+ */
+void coloc_screen::write_results(const dataset &d2, const vector<size_t> &nsnps, const vector<double> &pp, const vector<double> &grid_pp, ofstream &file, ofstream &grid_file)
+{
+	size_t g = prior_grid.size();
+
+	for (size_t i = 0; i < exposures.size(); i++) {
+		if (nsnps[i] == 0)
+			continue;
+
+		const double *p = &pp[6 * i];
+		file << exposures[i].name << "\t" << d2.name << "\tunconditioned\tunconditioned\t" << nsnps[i] << "\t" << p[H0] << "\t" << p[H1] << "\t" << p[H2] << "\t" << p[H3] << "\t" << p[H4] << "\t" << p[5] << "\n";
+
+		for (size_t k = 0; k < g; k++) {
+			const double *gp = &grid_pp[6 * g * i + 5 * k];
+			grid_file << exposures[i].name << "\t" << d2.name << "\tunconditioned\tunconditioned\t" << nsnps[i] << "\t" << prior_grid[k].p1 << "\t" << prior_grid[k].p2 << "\t" << prior_grid[k].p3
+				<< "\t" << gp[H0] << "\t" << gp[H1] << "\t" << gp[H2] << "\t" << gp[H3] << "\t" << gp[H4] << "\t" << grid_pp[6 * g * i + 5 * g + k] << "\n";
+		}
+	}
+}
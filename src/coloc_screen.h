@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <omp.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "data.h"
+#include "coloc.h"
+#include "helper_funcs.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+/*
+ * Unconditioned colocalisation of every exposure against every outcome (--coloc_only).
+ *
+ * Each dataset is read once and kept as columns over a SNP index shared by all
+ * datasets, so pairs are matched by a lookup rather than a join on names. The Bayes
+ * factors of a case-control trait do not depend on its partner and are computed once
+ * per dataset; those of a quantitative trait depend on its partner only through the
+ * sdY regression over the matched SNPs, which is summed during matching. Pairs are
+ * evaluated one outcome at a time, in parallel across the exposures.
+ *
+ * Results are the same as those of the initial colocalisation for each pair.
+ */
+class coloc_screen {
+public:
+	coloc_screen(string out, double p1, double p2, double p3, const vector<coloc_prior> &grid);
+
+	int add_datasets(const string &path, bool exposure, double n, double n_case, double pve, const string &pve_file);
+	void run();
+
+private:
+	struct dataset {
+		string name;
+		coloc_type type;
+		vector<uint32_t> snp; /// Shared index of each SNP, in file order
+		vector<char> usable; /// Beta and SE are finite and beta is non-zero
+		vector<double> beta;
+		vector<double> se;
+		vector<double> maf; /// Minor allele frequency; quantitative traits only
+		vector<double> n; /// Sample size; quantitative traits only
+		vector<double> labf; /// Log ABF of each SNP; case-control traits only
+	};
+
+	// Matched SNPs and Bayes factors of the pair being evaluated, reused between pairs
+	struct pair_buffers {
+		vector<uint32_t> rows1, rows2;
+		vector<double> beta, se, l1, l2;
+	};
+
+	void add_dataset(phenotype *pheno, bool exposure);
+	bool pair_labf(const dataset &d, const vector<uint32_t> &rows, pair_buffers &buf, vector<double> &labf);
+	size_t coloc_pair(const dataset &d1, const dataset &d2, const vector<int32_t> &pos2, pair_buffers &buf, double *pp, double *grid_pp);
+	void write_results(const dataset &d2, const vector<size_t> &nsnps, const vector<double> &pp, const vector<double> &grid_pp, ofstream &file, ofstream &grid_file);
+
+	unordered_map<string, uint32_t> snp_index; /// SNP name to shared index
+	vector<dataset> exposures;
+	vector<dataset> outcomes;
+
+	string outfile;
+	coloc_prior prior; /// --coloc_pp
+	vector<coloc_prior> prior_grid; /// --coloc_pp_grid
+};
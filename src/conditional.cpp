@@ -1,22 +1,31 @@
 #include "conditional.h"
 
+// Each diagonal entry of the inverse of a positive definite matrix is at least the
+// reciprocal of the matrix's own. Joint-model pivots and variances below this fraction
+// of that bound mean the inverse has lost its accuracy.
+static const double pivot_tol = 1e-6;
+
 /*
  * cond_analysis constructor
  */
-cond_analysis::cond_analysis(double p_cutoff, double collinear, double ld_window, string out, double top_snp, double freq_thres, string name, bool cond_ssize, bool verbose)
+cond_analysis::cond_analysis(double p_cutoff, double collinear, double collapse_r2, double ld_window, string out, double top_snp, double freq_thres, string name, bool cond_ssize, bool verbose)
 {
 	cname = name;
 	a_out = out;
 	a_p_cutoff = p_cutoff;
+	a_chisq_cutoff = qchisq1(p_cutoff);
 	a_collinear = collinear;
+	a_collapse_r2 = collapse_r2;
 	a_ld_window = ld_window;
 	a_freq_threshold = freq_thres;
 
 	a_top_snp = top_snp;
 
 	num_snps = 0;
-	cond_ssize = cond_ssize;
-	verbose = verbose;
+	this->cond_ssize = cond_ssize;
+	this->verbose = verbose;
+	ld = nullptr;
+	exact_z = false;
 }
 
 /*
@@ -27,7 +36,9 @@ cond_analysis::cond_analysis()
 	cname = "conditional-default";
 	a_out = "result";
 	a_p_cutoff = 5e-8;
+	a_chisq_cutoff = qchisq1(a_p_cutoff);
 	a_collinear = 0.9;
+	a_collapse_r2 = 0.0;
 	a_ld_window = 1e7;
 	a_freq_threshold = 0.2;
 
@@ -36,6 +47,8 @@ cond_analysis::cond_analysis()
 	num_snps = 0;
 	cond_ssize = false;
 	verbose = false;
+	ld = nullptr;
+	exact_z = false;
 }
 
 /*
@@ -43,7 +56,7 @@ cond_analysis::cond_analysis()
  * and calculating frequencies. 
  * From `gcta::init_massoc`.
  */
-void cond_analysis::init_conditional(phenotype *pheno, reference *ref)
+void cond_analysis::init_conditional(phenotype *pheno, reference *ref, locus_ld *ld)
 {
 	size_t j = 0;
 	size_t n, m;
@@ -53,16 +66,23 @@ void cond_analysis::init_conditional(phenotype *pheno, reference *ref)
 	jma_Vp = jma_Ve = pheno->get_variance();
 
 	n = to_include.size();
-	m = fam_ids_inc.size();
 
 	msx_b.resize(n);
 	nD.resize(n);
 
+	// Genotype variances and LD come from the locus, which may already hold them from another trait
+	// The orientation is taken now as ref_A is overwritten when the next analysis is matched
+	this->ld = ld;
+	ld_slot.resize(n);
+	ld_sign.resize(n);
+	for (j = 0; j < n; j++) {
+		ld_slot[j] = ld->slot(to_include[j]);
+		ld_sign[j] = ref->bim_allele1[to_include[j]] == ref->ref_A[to_include[j]] ? 1.0 : -1.0;
+	}
+
 #pragma omp parallel for
 	for (int i = 0; i < n; i++) {
-		eigenVector x;
-		makex_eigenVector(i, x, true, ref);
-		msx_b[i] = x.squaredNorm() / (double)m;
+		msx_b[i] = ld->variance(ld_slot[i]);
 	}
 
 	msx = 2.0 * ja_freq.array() * (1.0 - ja_freq.array());
@@ -193,14 +213,16 @@ void cond_analysis::match_gwas_phenotype(phenotype *pheno, reference *ref)
 		ja_beta_se[i] = pheno->se[idx[i]];
 		//ja_pval[i] = pheno->pval[idx[i]];
 		ja_chisq[i] = (ja_beta[i] / ja_beta_se[i]) * (ja_beta[i] / ja_beta_se[i]);
-		ja_pval[i] = pchisq(ja_chisq[i], 1.0);
 		ja_N_outcome[i] = pheno->n[idx[i]];
 		nsample[i] = pheno->n[idx[i]];
-		if (ctype == coloc_type::COLOC_CC) {
+	}
+	if (ctype == coloc_type::COLOC_CC) {
+		for (i = 0; i < to_include.size(); i++) {
 			ja_n_cases[i] = pheno->n_case[idx[i]];
 			ncases[i] = pheno->n_case[idx[i]];
 		}
 	}
+	pchisq1(ja_chisq.data(), ja_pval.data(), ja_chisq.size());
 
 	//if (out_cond) {
 	string filename = a_out + "." + pheno->get_phenoname() + ".included";
@@ -214,34 +236,66 @@ void cond_analysis::match_gwas_phenotype(phenotype *pheno, reference *ref)
 	//}
 }
 
-void cond_analysis::stepwise_select(vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &pC, reference *ref)
+/*
+ * Inverse of a symmetric matrix with row and column m removed, given the inverse A of
+ * the full matrix (block-inverse downdate).
+ */
+static eigenMatrix drop_from_inverse(const eigenMatrix &A, size_t m)
 {
-	vector<double> p_temp, chisq;
-	eigenVector2Vector(ja_pval, p_temp);
-	eigenVector2Vector(ja_chisq, chisq);
-	size_t i = 0, prev_num = 0,
-		//m = min_element(p_temp.begin(), p_temp.end()) - p_temp.begin();
-		m = max_element(chisq.begin(), chisq.end()) - chisq.begin();;
+	size_t i = 0, j = 0, k = A.rows();
+	eigenMatrix out(k - 1, k - 1);
+
+	for (j = 0; j < k; j++) {
+		if (j == m)
+			continue;
+		for (i = 0; i < k; i++) {
+			if (i == m)
+				continue;
+			out(i - (i > m), j - (j > m)) = A(i, j) - A(i, m) * A(m, j) / A(m, m);
+		}
+	}
+	return out;
+}
+
+static eigenVector drop_entry(const eigenVector &v, size_t m)
+{
+	eigenVector out(v.size() - 1);
+	out << v.head(m), v.tail(v.size() - m - 1);
+	return out;
+}
+
+/*
+ * Stepwise model selection over the given candidate SNPs. Candidates are ranked and
+ * thresholded on their chi-square statistics against a_chisq_cutoff, so P values
+ * are only evaluated for logging.
+ */
+void cond_analysis::stepwise_select(const vector<size_t> &candidates, vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC, reference *ref)
+{
+	size_t i = 0, prev_num = 0, m = candidates[0];
+	cdat->step_cache_ready = false;
+	cdat->step_snps = candidates;
+	stable_sort(cdat->step_snps.begin(), cdat->step_snps.end());
+
+	for (i = 1; i < candidates.size(); i++) {
+		if (ja_chisq[candidates[i]] > ja_chisq[m])
+			m = candidates[i];
+	}
 
 	spdlog::info("[{}] Selected SNP {} with chisq {:.2f} and pval {:.2e}.", cname, ja_snp_name[m], ja_chisq[m], ja_pval[m]);
-	if (ja_pval[m] >= a_p_cutoff) {
+	if (ja_chisq[m] <= a_chisq_cutoff) {
 		spdlog::info("[{}] SNP did not meet threshold.", cname);
 		return;
 	}
 	selected.push_back(m);
 
-	for (i = 0; i < to_include.size(); i++) {
-		if (i != m)
-			remain.push_back(i);
-	}
-
-	if (a_p_cutoff > 1e-3) {
-		spdlog::warn("P value level is too low for stepwise model.");
+	for (i = 0; i < candidates.size(); i++) {
+		if (candidates[i] != m)
+			remain.push_back(candidates[i]);
 	}
 
 	while (!remain.empty()) {
-		if (select_entry(selected, remain, cdat, bC, bC_se, pC, ref)) {
-			selected_stay(selected, cdat, bC, bC_se, pC, ref);
+		if (select_entry(selected, remain, cdat, bC, bC_se, chisqC, ref)) {
+			selected_stay(selected, cdat, bC, bC_se, chisqC, ref);
 		}
 		else
 			break;
@@ -255,10 +309,216 @@ void cond_analysis::stepwise_select(vector<size_t> &selected, vector<size_t> &re
 
 	if (a_p_cutoff > 1e-3) {
 		spdlog::info("Performing backward elimination...");
-		selected_stay(selected, cdat, bC, bC_se, pC, ref);
+		selected_stay(selected, cdat, bC, bC_se, chisqC, ref);
 	}
 
-	spdlog::info("[{}] Finally, {} associated SNPs have been selected.", cname, selected.size());
+	// Release the selection cache now the selection is done
+	cdat->step_cache_ready = false;
+	vector<size_t>().swap(cdat->step_snps);
+	eigenVector().swap(cdat->step_bC);
+	eigenVector().swap(cdat->step_bC_se);
+	eigenVector().swap(cdat->step_chisq);
+	vector<char>().swap(cdat->step_remain);
+	vector<size_t>().swap(cdat->step_dirty);
+	cdat->step_queue = step_queue_t();
+}
+
+/*
+ * Splits the included SNPs into LD blocks: runs of SNPs, ordered by position, where
+ * consecutive SNPs are on the same chromosome and closer than a_ld_window. SNPs in
+ * different blocks are in complete LE under the model.
+ */
+void cond_analysis::ld_blocks(vector<vector<size_t>> &blocks, reference *ref)
+{
+	size_t i = 0, n = to_include.size();
+	vector<size_t> order(n);
+
+	iota(order.begin(), order.end(), 0);
+	stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		size_t ra = to_include[a], rb = to_include[b];
+		return ref->bim_chr[ra] < ref->bim_chr[rb] || (ref->bim_chr[ra] == ref->bim_chr[rb] && ref->bim_bp[ra] < ref->bim_bp[rb]);
+	});
+
+	blocks.clear();
+	for (i = 0; i < n; i++) {
+		size_t cur = to_include[order[i]];
+		if (i == 0 || ref->bim_chr[cur] != ref->bim_chr[to_include[order[i - 1]]]
+			|| abs(ref->bim_bp[cur] - ref->bim_bp[to_include[order[i - 1]]]) >= a_ld_window)
+		{
+			blocks.push_back(vector<size_t>());
+		}
+		blocks.back().push_back(order[i]);
+	}
+
+	for (auto &b : blocks)
+		stable_sort(b.begin(), b.end());
+}
+
+/*
+ * Clusters SNPs in near-perfect LD before the stepwise selection. Going from the largest
+ * chi-square down, each SNP not yet clustered represents those of its neighbours (up to
+ * collapse_span either side by position) that are in LD above a_collapse_r2 with it.
+ * Only representatives are flagged in is_rep; the others are listed in collapsed.
+ */
+void cond_analysis::collapse_duplicates(vector<char> &is_rep, reference *ref)
+{
+	const size_t collapse_span = 50;
+	size_t i = 0, n = to_include.size();
+	vector<size_t> order(n), rank(n), by_chisq(n);
+	vector<char> assigned(n, 0);
+
+	iota(order.begin(), order.end(), 0);
+	stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		size_t ra = to_include[a], rb = to_include[b];
+		return ref->bim_chr[ra] < ref->bim_chr[rb] || (ref->bim_chr[ra] == ref->bim_chr[rb] && ref->bim_bp[ra] < ref->bim_bp[rb]);
+	});
+	for (i = 0; i < n; i++)
+		rank[order[i]] = i;
+
+	iota(by_chisq.begin(), by_chisq.end(), 0);
+	stable_sort(by_chisq.begin(), by_chisq.end(), [&](size_t a, size_t b) { return ja_chisq[a] > ja_chisq[b]; });
+
+	for (size_t c : by_chisq) {
+		if (assigned[c])
+			continue;
+		assigned[c] = 1;
+
+		vector<size_t> near, slots;
+		vector<double> d;
+		size_t lo = rank[c] > collapse_span ? rank[c] - collapse_span : 0,
+			hi = min(n, rank[c] + collapse_span + 1);
+		for (i = lo; i < hi; i++) {
+			size_t j = order[i];
+			if (assigned[j] || ref->bim_chr[to_include[j]] != ref->bim_chr[to_include[c]]
+				|| abs(ref->bim_bp[to_include[j]] - ref->bim_bp[to_include[c]]) >= a_ld_window)
+			{
+				continue;
+			}
+			near.push_back(j);
+			slots.push_back(ld_slot[j]);
+		}
+
+		ld->covariance(ld_slot[c], slots, d);
+		for (i = 0; i < near.size(); i++) {
+			if (d[i] * d[i] / (msx_b[c] * msx_b[near[i]]) >= a_collapse_r2) {
+				assigned[near[i]] = 1;
+				is_rep[near[i]] = 0;
+				collapsed.push_back(near[i]);
+			}
+		}
+	}
+}
+
+/*
+ * Combines the stepwise selections made in independent LD blocks into a single
+ * selection and conditional_dat. B, B_N and their inverses are block diagonal across
+ * LD blocks, so the combined matrices are assembled from the blocks' own results.
+ */
+void cond_analysis::merge_blocks(const vector<vector<size_t>> &blocks, vector<vector<size_t>> &part_sel, vector<vector<size_t>> &part_rem, vector<conditional_dat> &parts,
+	vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, reference *ref)
+{
+	typedef Triplet<eigenSparseMat::Scalar, long long> eigenTriplet;
+	size_t i = 0, p = 0, r = 0, k = 0;
+	vector<vector<size_t>> pos(parts.size());
+	vector<eigenTriplet> t_B, t_B_i, t_B_N, t_B_N_i;
+
+	selected.clear();
+	remain.clear();
+	for (p = 0; p < parts.size(); p++) {
+		copy(part_sel[p].begin(), part_sel[p].end(), back_inserter(selected));
+		if (part_sel[p].empty())
+			copy(blocks[p].begin(), blocks[p].end(), back_inserter(remain)); // Nothing conditioned on in this block
+		else
+			copy(part_rem[p].begin(), part_rem[p].end(), back_inserter(remain));
+	}
+	stable_sort(selected.begin(), selected.end());
+	stable_sort(remain.begin(), remain.end());
+	k = selected.size();
+	if (k == 0)
+		return;
+
+	for (p = 0; p < parts.size(); p++) {
+		if (part_sel[p].empty())
+			continue;
+		if (parts[p].B_N.cols() < 1 && !init_b(part_sel[p], &parts[p], ref))
+			spdlog::critical("There is a collinearity problem with the given list of SNPs.");
+		if (!parts[p].Z_ready)
+			init_z(part_sel[p], &parts[p], ref);
+
+		for (r = 0; r < part_sel[p].size(); r++)
+			pos[p].push_back(lower_bound(selected.begin(), selected.end(), part_sel[p][r]) - selected.begin());
+
+		auto add = [&](const eigenSparseMat &M, vector<eigenTriplet> &t) {
+			for (long long c = 0; c < M.outerSize(); c++)
+				for (eigenSparseMat::InnerIterator it(M, c); it; ++it)
+					t.push_back(eigenTriplet(pos[p][it.row()], pos[p][c], it.value()));
+		};
+		add(parts[p].B, t_B);
+		add(parts[p].B_i, t_B_i);
+		add(parts[p].B_N, t_B_N);
+		add(parts[p].B_N_i, t_B_N_i);
+	}
+
+	cdat->B.resize(k, k);
+	cdat->B_i.resize(k, k);
+	cdat->B_N.resize(k, k);
+	cdat->B_N_i.resize(k, k);
+	cdat->B.setFromTriplets(t_B.begin(), t_B.end());
+	cdat->B_i.setFromTriplets(t_B_i.begin(), t_B_i.end());
+	cdat->B_N.setFromTriplets(t_B_N.begin(), t_B_N.end());
+	cdat->B_N_i.setFromTriplets(t_B_N_i.begin(), t_B_N_i.end());
+
+	cdat->D_N.resize(k);
+	cdat->Z.resize(k);
+	cdat->Z_N.resize(k);
+	for (p = 0; p < parts.size(); p++) {
+		for (r = 0; r < pos[p].size(); r++) {
+			i = pos[p][r];
+			cdat->D_N[i] = parts[p].D_N[r];
+			cdat->Z[i] = std::move(parts[p].Z[r]);
+			cdat->Z_N[i] = std::move(parts[p].Z_N[r]);
+		}
+	}
+	cdat->Z_ready = true;
+}
+
+/*
+ * Cheap check of whether adding pos to the selected SNPs must fail the collinearity
+ * check in insert_B_Z. With z the candidate's LD with the selected SNPs, u = B_i * z
+ * and the Schur complement s = B(pos, pos) - z' * u, the diagonal of the enlarged
+ * inverse is B_i(r, r) + u_r^2 / s for the selected SNPs and 1 / s for pos. Only clear
+ * failures are rejected here; anything borderline goes through the full rebuild.
+ * Z only tells which entries of z lie in the LD window: its rows may be float, whose
+ * rounding is far above the margin when s is small, so z is taken from ld_cov in double
+ * as insert_B_Z does.
+ */
+bool cond_analysis::collinear_prescreen(const vector<size_t> &selected, size_t pos, conditional_dat *cdat)
+{
+	const double margin = 1e-8;
+	size_t r = 0, k = selected.size();
+
+	if (!cdat->Z_ready || k == 0 || cdat->B_i.rows() != k || cdat->Z.size() != k)
+		return false;
+
+	eigenVector z = eigenVector::Zero(k);
+	for (r = 0; r < k; r++) {
+		if (cdat->Z[r].coeff(pos) != 0)
+			z[r] = ld_cov(selected[r], pos);
+	}
+
+	eigenVector u = cdat->B_i * z;
+	double s = msx_b[pos] - z.dot(u);
+	if (s <= 0)
+		return true;
+	if (1 - s / msx_b[pos] > a_collinear + margin)
+		return true;
+
+	eigenVector B_i_diag = cdat->B_i.diagonal();
+	for (r = 0; r < k; r++) {
+		if (1 - 1 / (msx_b[selected[r]] * (B_i_diag[r] + u[r] * u[r] / s)) > a_collinear + margin)
+			return true;
+	}
+	return false;
 }
 
 bool cond_analysis::insert_B_Z(const vector<size_t> &idx, size_t pos, conditional_dat *cdat, reference *ref)
@@ -279,7 +539,6 @@ bool cond_analysis::insert_B_Z(const vector<size_t> &idx, size_t pos, conditiona
 
 	p = find(ix.begin(), ix.end(), pos) - ix.begin();
 	eigenVector diagB(ix.size());
-	eigenVector x_i(n), x_j(n);
 	for (j = 0; j < ix.size(); j++) {
 		cdat->B.startVec(j);
 		cdat->B_N.startVec(j);
@@ -291,7 +550,6 @@ bool cond_analysis::insert_B_Z(const vector<size_t> &idx, size_t pos, conditiona
 			get_ins_col = true;
 		}
 		get_ins_row = get_ins_col;
-		makex_eigenVector(ix[j], x_j, false, ref);
 		
 		for (i = j + 1; i < ix.size(); i++) {
 			if (pos == ix[i])
@@ -302,8 +560,7 @@ bool cond_analysis::insert_B_Z(const vector<size_t> &idx, size_t pos, conditiona
 						&& abs(ref->bim_bp[to_include[ix[i]]] - ref->bim_bp[to_include[ix[j]]]) < a_ld_window)
 					)
 				{
-					makex_eigenVector(ix[i], x_i, false, ref);
-					d_temp = x_i.dot(x_j) / (double)n;
+					d_temp = ld_cov(ix[i], ix[j]);
 					cdat->B.insertBack(i, j) = d_temp;
 					cdat->B_N.insertBack(i, j) = d_temp
 											* min(nD[ix[i]], nD[ix[j]])
@@ -323,18 +580,21 @@ bool cond_analysis::insert_B_Z(const vector<size_t> &idx, size_t pos, conditiona
 	cdat->B.finalize();
 	cdat->B_N.finalize();
 
+	// B_i is only replaced once the SNP is accepted so it stays consistent with B on rejection
 	SimplicialLDLT<eigenSparseMat> ldlt_B(cdat->B);
-	cdat->B_i.resize(ix.size(), ix.size());
-	cdat->B_i.setIdentity();
-	cdat->B_i = ldlt_B.solve(cdat->B_i).eval();
+	eigenSparseMat B_i(ix.size(), ix.size());
+	B_i.setIdentity();
+	B_i = ldlt_B.solve(B_i).eval();
 	if (ldlt_B.vectorD().minCoeff() < 0 || sqrt(ldlt_B.vectorD().maxCoeff() / ldlt_B.vectorD().minCoeff()) > 30
-		|| (1 - eigenVector::Constant(ix.size(), 1).array() / (diagB.array() * cdat->B_i.diagonal().array())).maxCoeff() > a_collinear)
+		|| (1 - eigenVector::Constant(ix.size(), 1).array() / (diagB.array() * B_i.diagonal().array())).maxCoeff() > a_collinear)
 	{
+#pragma omp atomic
 		jma_snpnum_collinear++;
 		cdat->B = B_temp;
 		cdat->B_N = B_N_temp;
 		return false;
 	}
+	cdat->B_i = std::move(B_i);
 
 	SimplicialLDLT<eigenSparseMat> ldlt_B_N(cdat->B_N);
 	cdat->B_N_i.resize(ix.size(), ix.size());
@@ -345,158 +605,242 @@ bool cond_analysis::insert_B_Z(const vector<size_t> &idx, size_t pos, conditiona
 		cdat->D_N[j] = msx[ix[j]] * nD[ix[j]];
 	}
 
-	if (cdat->Z_N.cols() < 1)
+	if (!cdat->Z_ready)
 		return true;
 
-	eigenSparseMat Z_temp(cdat->Z), Z_N_temp(cdat->Z_N);
-	cdat->Z.resize(ix.size(), m);
-	cdat->Z_N.resize(ix.size(), m);
-
-	for (j = 0; j < m; j++) {
-		cdat->Z.startVec(j);
-		cdat->Z_N.startVec(j);
-
-		get_ins_row = false;
-		makex_eigenVector(j, x_j, false, ref);
-		for (i = 0; i < ix.size(); i++) {
-			if (pos == ix[i]) {
-				if ((ix[i] != j 
-						&& ref->bim_chr[to_include[ix[i]]] == ref->bim_chr[to_include[j]]
-						&& abs(ref->bim_bp[to_include[ix[i]]] - ref->bim_bp[to_include[j]]) < a_ld_window)
-					)
-				{
-					makex_eigenVector(ix[i], x_i, false, ref);
-					d_temp = x_j.dot(x_i) / (double)n;
-					cdat->Z.insertBack(i, j) = d_temp;
-					cdat->Z_N.insertBack(i, j) = d_temp
-											* min(nD[ix[i]], nD[j])
-											* sqrt(msx[ix[i]] * msx[j] / (msx_b[ix[i]] * msx_b[j]));
-				}
-				get_ins_row = true;
-			}
-			else {
-				size_t ins_row_val = get_ins_row ? 1 : 0;
-				if (Z_temp.coeff(i - ins_row_val, j) != 0) {
-					cdat->Z.insertBack(i, j) = Z_temp.coeff(i - ins_row_val, j);
-					cdat->Z_N.insertBack(i, j) = Z_N_temp.coeff(i - ins_row_val, j);
-				}
-			}
-		}
-	}
-
-	cdat->Z.finalize();
-	cdat->Z_N.finalize();
+	// Only the new SNP's row of Z/Z_N changes; slot it in at the same position as in B
+	eigenSparseVec z, z_n;
+	make_z_row(pos, z, z_n, ref);
+	cdat->Z.insert(cdat->Z.begin() + p, std::move(z));
+	cdat->Z_N.insert(cdat->Z_N.begin() + p, std::move(z_n));
 	return true;
 }
 
-void cond_analysis::erase_B_and_Z(const vector<size_t> &idx, size_t erase, conditional_dat *cdat)
+/*
+ * Removes every SNP not flagged in keep from idx, B, B_N, D_N and the Z rows in one
+ * pass. If the caller has already downdated the inverses they are compacted from
+ * B_i/B_N_i, otherwise B and B_N are refactorised.
+ */
+void cond_analysis::compact_B_and_Z(vector<size_t> &idx, const vector<char> &keep, conditional_dat *cdat, const eigenMatrix *B_i, const eigenMatrix *B_N_i)
 {
-	bool get_ins_col = false, get_ins_row = false;
-	size_t i = 0, j = 0,
-		i_size = idx.size(),
-		pos = find(idx.begin(), idx.end(), erase) - idx.begin(),
-		m = to_include.size();
-	eigenSparseMat B_dense(cdat->B), B_N_dense(cdat->B_N);
-
-	cdat->B.resize(i_size - 1, i_size - 1);
-	cdat->B_N.resize(i_size - 1, i_size - 1);
-	cdat->D_N.resize(i_size - 1);
+	typedef Triplet<eigenSparseMat::Scalar, long long> eigenTriplet;
+	size_t i = 0, j = 0, k = idx.size(), n = 0;
+	vector<long long> new_pos(k, -1);
+	vector<size_t> kept;
+	vector<eigenTriplet> t_B, t_B_N;
+
+	for (i = 0; i < k; i++) {
+		if (keep[i]) {
+			new_pos[i] = n++;
+			kept.push_back(idx[i]);
+		}
+	}
 
-	for (j = 0; j < i_size; j++) {
-		if (erase == idx[j]) {
-			get_ins_col = true;
+	for (long long c = 0; c < cdat->B.outerSize(); c++) {
+		if (!keep[c])
 			continue;
+		for (eigenSparseMat::InnerIterator it(cdat->B, c); it; ++it) {
+			if (keep[it.row()])
+				t_B.push_back(eigenTriplet(new_pos[it.row()], new_pos[c], it.value()));
 		}
-
-		cdat->B.startVec(j - get_ins_col);
-		cdat->B_N.startVec(j - get_ins_col);
-		cdat->D_N[j - (get_ins_col ? 1 : 0)] = msx[idx[j]] * nD[idx[j]];
-		get_ins_row = get_ins_col;
-
-		for (i = j; i < i_size; i++) {
-			if (erase == idx[i]) {
-				get_ins_row = true;
+		for (eigenSparseMat::InnerIterator it(cdat->B_N, c); it; ++it) {
+			if (keep[it.row()])
+				t_B_N.push_back(eigenTriplet(new_pos[it.row()], new_pos[c], it.value()));
+		}
+	}
+	cdat->B.resize(n, n);
+	cdat->B_N.resize(n, n);
+	cdat->B.setFromTriplets(t_B.begin(), t_B.end());
+	cdat->B_N.setFromTriplets(t_B_N.begin(), t_B_N.end());
+	cdat->D_N.resize(n);
+	for (j = 0; j < n; j++)
+		cdat->D_N[j] = msx[kept[j]] * nD[kept[j]];
+	idx.swap(kept);
+
+	if (B_i != nullptr && B_N_i != nullptr) {
+		eigenMatrix Bi(n, n), BNi(n, n);
+		for (j = 0; j < k; j++) {
+			if (!keep[j])
 				continue;
-			}
-
-			if (B_dense.coeff(i, j) != 0) {
-				size_t ins_row_val = get_ins_row ? 1 : 0,
-					ins_col_val = get_ins_col ? 1 : 0;
-				cdat->B.insertBack(i - ins_row_val, j - ins_col_val) = B_dense.coeff(i, j);
-				cdat->B_N.insertBack(i - ins_row_val, j - ins_col_val) = B_N_dense.coeff(i, j);
+			for (i = 0; i < k; i++) {
+				if (!keep[i])
+					continue;
+				Bi(new_pos[i], new_pos[j]) = (*B_i)(i, j);
+				BNi(new_pos[i], new_pos[j]) = (*B_N_i)(i, j);
 			}
 		}
+		cdat->B_i = Bi.sparseView();
+		cdat->B_N_i = BNi.sparseView();
+	}
+	else {
+		SimplicialLDLT<eigenSparseMat> ldlt_B(cdat->B);
+		cdat->B_i.resize(n, n);
+		cdat->B_i.setIdentity();
+		cdat->B_i = ldlt_B.solve(cdat->B_i).eval();
+		SimplicialLDLT<eigenSparseMat> ldlt_B_N(cdat->B_N);
+		cdat->B_N_i.resize(n, n);
+		cdat->B_N_i.setIdentity();
+		cdat->B_N_i = ldlt_B_N.solve(cdat->B_N_i).eval();
 	}
-	cdat->B.finalize();
-	cdat->B_N.finalize();
 
-	if (cdat->Z_N.cols() < 1)
+	if (!cdat->Z_ready)
 		return;
 
-	SimplicialLDLT<eigenSparseMat> ldlt_B(cdat->B);
-	cdat->B_i.resize(i_size - 1, i_size - 1);
-	cdat->B_i.setIdentity();
-
-	cdat->B_i = ldlt_B.solve(cdat->B_i).eval();
-	SimplicialLDLT<eigenSparseMat> ldlt_B_N(cdat->B_N);
-	cdat->B_N_i.resize(i_size - 1, i_size - 1);
-	cdat->B_N_i.setIdentity();
-	cdat->B_N_i = ldlt_B_N.solve(cdat->B_N_i).eval();
-
-	eigenSparseMat Z_temp(cdat->Z), Z_N_temp(cdat->Z_N);
-	cdat->Z.resize(i_size - 1, m);
-	cdat->Z_N.resize(i_size - 1, m);
-	for (j = 0; j < m; j++) {
-		cdat->Z.startVec(j);
-		cdat->Z_N.startVec(j);
-		get_ins_row = false;
-		for (i = 0; i < i_size; i++) {
-			if (erase == idx[i]) {
-				get_ins_row = true;
-				continue;
-			}
-
-			if (Z_temp.coeff(i, j) != 0) {
-				size_t ins_row_val = get_ins_row ? 1 : 0;
-				cdat->Z.insertBack(i - ins_row_val, j) = Z_temp.coeff(i, j);
-				cdat->Z_N.insertBack(i - ins_row_val, j) = Z_N_temp.coeff(i, j);
-			}
+	for (i = 0, j = 0; i < k; i++) {
+		if (!keep[i])
+			continue;
+		if (i != j) {
+			cdat->Z[j] = std::move(cdat->Z[i]);
+			cdat->Z_N[j] = std::move(cdat->Z_N[i]);
 		}
+		j++;
 	}
-	cdat->Z.finalize();
-	cdat->Z_N.finalize();
+	cdat->Z.resize(n);
+	cdat->Z_N.resize(n);
 }
 
-bool cond_analysis::select_entry(vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &pC, reference *ref)
+/*
+ * Forward selection step. Conditional statistics for the remaining SNPs are kept
+ * between iterations and only those SNPs whose Z columns touch the part of B that
+ * changed with the last selection are recomputed; the largest chi-square statistic
+ * is then taken from a priority queue.
+ */
+bool cond_analysis::select_entry(vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC, reference *ref)
 {
-	size_t m = 0;
-	vector<double> pC_temp;
-
-	massoc_conditional(selected, remain, cdat, bC, bC_se, pC, ref);
+	size_t i = 0, j = 0, l = 0, n = cdat->step_snps.size();
+
+	if (!cdat->step_cache_ready) {
+		massoc_conditional(selected, remain, cdat, bC, bC_se, chisqC, ref);
+
+		cdat->step_bC = eigenVector::Zero(n);
+		cdat->step_bC_se = eigenVector::Zero(n);
+		cdat->step_chisq = eigenVector::Constant(n, -1);
+		cdat->step_remain.assign(n, 0);
+		cdat->step_queue = step_queue_t();
+		for (i = 0; i < remain.size(); i++) {
+			l = cdat->step_pos(remain[i]);
+			cdat->step_bC[l] = bC[i];
+			cdat->step_bC_se[l] = bC_se[i];
+			cdat->step_chisq[l] = chisqC[i];
+			cdat->step_remain[l] = 1;
+			cdat->step_queue.push(make_pair(cdat->step_chisq[l], remain[i]));
+		}
+		cdat->step_dirty.clear();
+		cdat->step_cache_ready = true;
+	}
+	else if (!cdat->step_dirty.empty()) {
+		massoc_conditional(selected, cdat->step_dirty, cdat, bC, bC_se, chisqC, ref);
+		for (i = 0; i < cdat->step_dirty.size(); i++) {
+			l = cdat->step_pos(cdat->step_dirty[i]);
+			cdat->step_bC[l] = bC[i];
+			cdat->step_bC_se[l] = bC_se[i];
+			cdat->step_chisq[l] = chisqC[i];
+			cdat->step_queue.push(make_pair(cdat->step_chisq[l], cdat->step_dirty[i]));
+		}
+		cdat->step_dirty.clear();
+	}
 
-	eigenVector2Vector(pC, pC_temp);
+	// Report statistics for the full remain list as before
+	bC.resize(remain.size());
+	bC_se.resize(remain.size());
+	chisqC.resize(remain.size());
+	for (i = 0; i < remain.size(); i++) {
+		l = cdat->step_pos(remain[i]);
+		bC[i] = cdat->step_bC[l];
+		bC_se[i] = cdat->step_bC_se[l];
+		chisqC[i] = cdat->step_chisq[l];
+	}
 
-	while (true) {
-		m = min_element(pC_temp.begin(), pC_temp.end()) - pC_temp.begin();
-		spdlog::info("[{}] Selected entry SNP {} with cpval {:.2e}.", cname, ja_snp_name[m], pC_temp[m]);
-		if (pC_temp[m] >= a_p_cutoff) {
-			spdlog::info("[{}] {} does not meet threshold", cname, ja_snp_name[m]);
+	while (!cdat->step_queue.empty()) {
+		pair<double, size_t> top = cdat->step_queue.top();
+		cdat->step_queue.pop();
+		j = top.second;
+		l = cdat->step_pos(j);
+		if (!cdat->step_remain[l] || top.first != cdat->step_chisq[l])
+			continue; // Stale entry
+
+		spdlog::info("[{}] Selected entry SNP {} with cpval {:.2e}.", cname, ja_snp_name[j], cdat->step_chisq[l] < 0 ? 2.0 : pchisq1(cdat->step_chisq[l]));
+		if (cdat->step_chisq[l] <= a_chisq_cutoff) {
+			spdlog::info("[{}] {} does not meet threshold", cname, ja_snp_name[j]);
 			return false;
 		}
 
-		if (insert_B_Z(selected, remain[m], cdat, ref)) {
-			selected.push_back(remain[m]);
+		cdat->step_remain[l] = 0;
+		remain.erase(find(remain.begin(), remain.end(), j));
+		if (collinear_prescreen(selected, j, cdat)) {
+#pragma omp atomic
+			jma_snpnum_collinear++;
+#pragma omp atomic
+			jma_snpnum_prescreen++;
+			continue;
+		}
+		if (insert_B_Z(selected, j, cdat, ref)) {
+			selected.push_back(j);
 			stable_sort(selected.begin(), selected.end());
-			remain.erase(remain.begin() + m);
+			mark_dirty(selected, j, cdat);
 			return true;
 		}
+	}
+	return false;
+}
 
-		pC_temp.erase(pC_temp.begin() + m);
-		remain.erase(remain.begin() + m);
+/*
+ * Marks the remaining SNPs whose conditional statistics change after pos has been
+ * added to B: B_i and B_N_i only change within the block of B connected to pos,
+ * so these are the SNPs with a non-zero Z entry in any row of that block.
+ */
+void cond_analysis::mark_dirty(const vector<size_t> &selected, size_t pos, conditional_dat *cdat)
+{
+	size_t k = selected.size(),
+		start = find(selected.begin(), selected.end(), pos) - selected.begin();
+	vector<vector<size_t>> adj(k);
+	vector<char> in_block(k, 0), seen(cdat->step_snps.size(), 0);
+	vector<size_t> stack(1, start);
+
+	for (long long c = 0; c < cdat->B.outerSize(); c++) {
+		for (eigenSparseMat::InnerIterator it(cdat->B, c); it; ++it) {
+			if (it.row() == c)
+				continue;
+			adj[it.row()].push_back(c);
+			adj[c].push_back(it.row());
+		}
 	}
+
+	in_block[start] = 1;
+	cdat->step_dirty.clear();
+	while (!stack.empty()) {
+		size_t r = stack.back();
+		stack.pop_back();
+
+		if (cdat->Z_ready) {
+			// Z rows and step_snps are both sorted, so walk them together
+			const eigenSparseVec &z = cdat->Z[r];
+			const long long *idx = z.innerIndexPtr(), *last = idx + z.nonZeros();
+			size_t l = idx == last ? 0 : lower_bound(cdat->step_snps.begin(), cdat->step_snps.end(), (size_t)*idx) - cdat->step_snps.begin();
+			while (l < cdat->step_snps.size() && idx != last) {
+				if ((long long)cdat->step_snps[l] < *idx) {
+					l++;
+					continue;
+				}
+				if ((long long)cdat->step_snps[l] == *idx && cdat->step_remain[l] && !seen[l]) {
+					seen[l] = 1;
+					cdat->step_dirty.push_back(cdat->step_snps[l]);
+				}
+				idx++;
+			}
+		}
+
+		for (auto c : adj[r]) {
+			if (!in_block[c]) {
+				in_block[c] = 1;
+				stack.push_back(c);
+			}
+		}
+	}
+	stable_sort(cdat->step_dirty.begin(), cdat->step_dirty.end());
 }
 
-void cond_analysis::selected_stay(vector<size_t> &select, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref)
+void cond_analysis::selected_stay(vector<size_t> &select, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &chisqJ, reference *ref)
 {
 	if (cdat->B_N.cols() < 1) {
 		if (!init_b(select, cdat, ref)) {
@@ -504,29 +848,120 @@ void cond_analysis::selected_stay(vector<size_t> &select, conditional_dat *cdat,
 			return;
 		}
 	}
+	if (select.empty())
+		return;
 
-	vector<double> pJ_temp;
-	while (!select.empty()) {
-		massoc_joint(select, cdat, bJ, bJ_se, pJ, ref);
-		eigenVector2Vector(pJ, pJ_temp);
-		size_t m = max_element(pJ_temp.begin(), pJ_temp.end()) - pJ_temp.begin();
-		if (pJ[m] > a_p_cutoff) {
-			jma_snpnum_backward++;
-			erase_B_and_Z(select, select[m], cdat);
-			select.erase(select.begin() + m);
-			spdlog::info("[{}] Erasing SNP {}.", cname, ja_snp_name[m]);
+	// Dropping SNP m from a model with inverse A leaves A - A.col(m) * A.row(m) / A(m, m)
+	// as the inverse for the others, so each elimination is an O(k^2) downdate and the
+	// matrices are only compacted once at the end. A degenerate pivot would make the
+	// downdate meaningless, so then the remaining SNPs are refactorised before going on.
+	size_t i = 0, m = 0, k = select.size(), dropped = 0;
+	eigenMatrix W(cdat->B_i), W_N(cdat->B_N_i);
+	eigenVector Db(k);
+	vector<char> keep(k, 1);
+	bool fresh = false;
+
+	for (i = 0; i < k; i++)
+		Db[i] = cdat->D_N[i] * ja_beta[select[i]];
+
+	while (dropped < k) {
+		if (!fresh) {
+			bJ = W_N * Db;
+			bJ_se = W_N.diagonal() * jma_Ve;
+			chisqJ = eigenVector::Zero(k);
+			for (i = 0; i < k; i++) {
+				if (keep[i] && W_N(i, i) * cdat->D_N[i] >= pivot_tol) {
+					bJ_se[i] = sqrt(bJ_se[i]);
+					chisqJ[i] = (bJ[i] / bJ_se[i]) * (bJ[i] / bJ_se[i]);
+				}
+				else {
+					bJ[i] = 0.0;
+					bJ_se[i] = 0.0;
+				}
+			}
 		}
-		else {
+		fresh = false;
+
+		m = k;
+		for (i = 0; i < k; i++) {
+			if (keep[i] && (m == k || chisqJ[i] < chisqJ[m]))
+				m = i;
+		}
+		if (chisqJ[m] >= a_chisq_cutoff)
 			break;
+
+#pragma omp atomic
+		jma_snpnum_backward++;
+		cdat->step_cache_ready = false;
+		spdlog::info("[{}] Erasing SNP {}.", cname, ja_snp_name[select[m]]);
+		keep[m] = 0;
+		dropped++;
+
+		if (!(W_N(m, m) * cdat->D_N[m] >= pivot_tol && W(m, m) * msx_b[select[m]] >= pivot_tol)) {
+			// Refactorise what is left and carry on from its joint statistics
+			compact_B_and_Z(select, keep, cdat, nullptr, nullptr);
+			k = select.size();
+			dropped = 0;
+			if (k == 0) {
+				bJ.resize(0);
+				bJ_se.resize(0);
+				chisqJ.resize(0);
+				return;
+			}
+			massoc_joint(select, cdat, bJ, bJ_se, chisqJ, ref);
+			W = cdat->B_i;
+			W_N = cdat->B_N_i;
+			Db.resize(k);
+			for (i = 0; i < k; i++)
+				Db[i] = cdat->D_N[i] * ja_beta[select[i]];
+			keep.assign(k, 1);
+			fresh = true;
+			continue;
+		}
+
+		eigenVector c = W_N.col(m);
+		W_N.noalias() -= c * c.transpose() / c[m];
+		c = W.col(m);
+		W.noalias() -= c * c.transpose() / c[m];
+		W_N.row(m).setZero();
+		W_N.col(m).setZero();
+		W.row(m).setZero();
+		W.col(m).setZero();
+		Db[m] = 0.0;
+	}
+
+	if (dropped > 0) {
+		vector<size_t> pos;
+		for (i = 0; i < k; i++) {
+			if (keep[i])
+				pos.push_back(i);
+		}
+		compact_B_and_Z(select, keep, cdat, &W, &W_N);
+
+		eigenVector b = bJ, b_se = bJ_se, c = chisqJ;
+		bJ.resize(pos.size());
+		bJ_se.resize(pos.size());
+		chisqJ.resize(pos.size());
+		for (i = 0; i < pos.size(); i++) {
+			bJ[i] = b[pos[i]];
+			bJ_se[i] = b_se[pos[i]];
+			chisqJ[i] = c[pos[i]];
 		}
 	}
 }
 
-void cond_analysis::massoc_conditional(const vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &pC, reference *ref)
+/*
+ * Conditional betas, SEs and p values for every remaining SNP given the selected set.
+ * The remaining SNPs are processed in blocks of columns: each block of Z/Z_N is
+ * expanded to dense once and reduced column-wise, rather than forming a sparse
+ * vector-matrix product per SNP. The remain list is normally in ascending order,
+ * so a block spans a narrow range of each (sorted) Z row.
+ * Returns chi-square statistics; SNPs that cannot be tested are given -1 (see massoc_pval).
+ */
+void cond_analysis::massoc_conditional(const vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC, reference *ref)
 {
-	size_t i = 0, j = 0, n = selected.size(), m = remain.size();
-	double chisq = 0.0, B2 = 0.0;
-	eigenVector b(n), se(n);
+	size_t i = 0, n = selected.size();
+	eigenVector b(n);
 
 	if (cdat->B_N.cols() < 1) {
 		if (!init_b(selected, cdat, ref)) {
@@ -535,63 +970,122 @@ void cond_analysis::massoc_conditional(const vector<size_t> &selected, vector<si
 		}
 	}
 
-	if (cdat->Z_N.cols() < 1) {
+	if (!cdat->Z_ready) {
 		init_z(selected, cdat, ref);
 	}
 
 	for (i = 0; i < n; i++) {
 		b[i] = ja_beta[selected[i]];
-		se[i] = ja_beta_se[selected[i]];
 	}
 
-	eigenVector Z_Bi(n), Z_Bi_temp(n);
+	// Z_N.col(j)' * B_N_i * D_N * b for every j only needs this projection once
+	eigenVector w = cdat->B_N_i * cdat->D_N.cwiseProduct(b);
+	vector<size_t> rows(n);
+	iota(rows.begin(), rows.end(), 0);
+	massoc_conditional(selected, rows, remain, cdat, eigenMatrix(cdat->B_i), w, bC, bC_se, chisqC);
+}
+
+/*
+ * Conditional statistics for the remain SNPs given the selected SNPs, whose Z rows are
+ * cdat->Z[rows[r]]. B_i is the inverse of B over the selected SNPs and w = B_N_i * D_N * b.
+ * cdat is only read so the same stepwise state can be shared between calls.
+ */
+void cond_analysis::massoc_conditional(const vector<size_t> &selected, const vector<size_t> &rows, const vector<size_t> &remain, const conditional_dat *cdat,
+	const eigenMatrix &B_i_dense, const eigenVector &w, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC)
+{
+	const int block_size = 256;
+	size_t i = 0, n = selected.size(), m = remain.size();
+	eigenVector r2(m), zw(m);
+	int num_blocks = (int)((m + block_size - 1) / block_size);
+
+#pragma omp parallel for
+	for (int blk = 0; blk < num_blocks; blk++) {
+		size_t start = (size_t)blk * block_size,
+			cols = min((size_t)block_size, m - start);
+		eigenMatrix Z_blk = eigenMatrix::Zero(n, cols),
+			Z_N_blk = eigenMatrix::Zero(n, cols);
+
+		// The block's SNPs in ascending order with their columns, to be walked along each Z row
+		vector<pair<long long, size_t>> col_snp(cols);
+		for (size_t c = 0; c < cols; c++)
+			col_snp[c] = make_pair((long long)remain[start + c], c);
+		sort(col_snp.begin(), col_snp.end());
+		long long lo = col_snp.front().first, hi = col_snp.back().first;
+
+		for (size_t r = 0; r < n; r++) {
+			const eigenSparseVec &z = cdat->Z[rows[r]], &z_n = cdat->Z_N[rows[r]];
+			const long long *first = z.innerIndexPtr(), *last = first + z.nonZeros();
+			size_t c = 0;
+			for (const long long *it = lower_bound(first, last, lo); it != last && *it <= hi; it++) {
+				while (c < cols && col_snp[c].first < *it)
+					c++;
+				if (c == cols)
+					break;
+				if (col_snp[c].first != *it)
+					continue;
+				if (exact_z) {
+					double d = ld_cov(selected[r], *it);
+					Z_blk(r, col_snp[c].second) = d;
+					Z_N_blk(r, col_snp[c].second) = z_n_entry(selected[r], *it, d);
+				}
+				else {
+					Z_blk(r, col_snp[c].second) = z.valuePtr()[it - first];
+					Z_N_blk(r, col_snp[c].second) = z_n.valuePtr()[it - first];
+				}
+			}
+		}
+
+		// Diagonal of Z' * B_i * Z for collinearity, and Z_N' * w for the betas
+		r2.segment(start, cols) = Z_blk.cwiseProduct(B_i_dense * Z_blk).colwise().sum().transpose();
+		zw.segment(start, cols) = Z_N_blk.transpose() * w;
+	}
+
 	bC = eigenVector::Zero(m);
 	bC_se = eigenVector::Zero(m);
-	pC = eigenVector::Constant(m, 2);
+	chisqC = eigenVector::Constant(m, -1);
 	for (i = 0; i < m; i++) {
-		j = remain[i];
-		B2 = msx[j] * nD[j];
-		if (!isFloatEqual(B2, 0.0)) {
-			Z_Bi = cdat->Z_N.col(j).transpose() * cdat->B_N_i;
-			Z_Bi_temp = cdat->Z.col(j).transpose() * cdat->B_i;
-			if (cdat->Z.col(j).dot(Z_Bi_temp) / msx_b[j] < a_collinear) {
-				bC[i] = ja_beta[j] - Z_Bi.cwiseProduct(cdat->D_N).dot(b) / B2;
-				bC_se[i] = 1.0 / B2; //(B2 - Z_N.col(j).dot(Z_Bi)) / (B2 * B2);
-			}
+		size_t j = remain[i];
+		double B2 = msx[j] * nD[j];
+		if (!isFloatEqual(B2, 0.0) && r2[i] / msx_b[j] < a_collinear) {
+			bC[i] = ja_beta[j] - zw[i] / B2;
+			bC_se[i] = 1.0 / B2; //(B2 - Z_N.col(j).dot(Z_Bi)) / (B2 * B2);
 		}
 		bC_se[i] *= jma_Ve;
 		if (bC_se[i] > 1e-10 * jma_Vp) {
 			bC_se[i] = sqrt(bC_se[i]);
-			chisq = bC[i] / bC_se[i];
-			pC[i] = pchisq(chisq * chisq, 1);
+			chisqC[i] = (bC[i] / bC_se[i]) * (bC[i] / bC_se[i]);
 		}
 	}
 }
 
-void cond_analysis::makex_eigenVector(size_t j, eigenVector &x, bool resize, reference *ref)
+/*
+ * Converts conditional chi-square statistics to P values in one batch.
+ * Untestable SNPs (negative statistics) are given a P value of 2.
+ */
+void cond_analysis::massoc_pval(const eigenVector &chisq, eigenVector &pval)
 {
-	size_t n = fam_ids_inc.size(),
-		m = to_include.size();
+	pval.resize(chisq.size());
+	pchisq1(chisq.data(), pval.data(), chisq.size());
+	for (long long i = 0; i < chisq.size(); i++) {
+		if (chisq[i] < 0)
+			pval[i] = 2;
+	}
+}
 
-	if (resize)
-		x.resize(n);
+/*
+ * Covariance between SNPs i and j in this analysis's allele orientation.
+ */
+double cond_analysis::ld_cov(size_t i, size_t j)
+{
+	return ld_sign[i] * ld_sign[j] * ld->covariance(ld_slot[i], ld_slot[j]);
+}
 
-#pragma omp parallel for
-	for (int i = 0; i < n; i++) {
-		if (!ref->bed_snp_1[to_include[j]][fam_ids_inc[i]] || ref->bed_snp_2[to_include[j]][fam_ids_inc[i]])
-		{
-			double snp1 = ref->bed_snp_1[to_include[j]][fam_ids_inc[i]] ? 1.0 : 0.0,
-				snp2 = ref->bed_snp_2[to_include[j]][fam_ids_inc[i]] ? 1.0 : 0.0;
-			if (ref->bim_allele1[to_include[j]] == ref->ref_A[to_include[j]])
-				x[i] = snp1 + snp2;
-			else
-				x[i] = 2.0 - (snp1 + snp2);
-		}
-		else {
-			x[i] = mu[to_include[j]];
-		}
-		x[i] -= mu[to_include[j]];
-	}
+/*
+ * Entry of Z_N for SNPs i and j, whose covariance is cov.
+ */
+double cond_analysis::z_n_entry(size_t i, size_t j, double cov)
+{
+	return cov * min(nD[i], nD[j]) * sqrt(msx[i] * msx[j] / (msx_b[i] * msx_b[j]));
 }
 
 bool cond_analysis::init_b(const vector<size_t> &idx, conditional_dat *cdat, reference *ref)
@@ -600,9 +1094,7 @@ bool cond_analysis::init_b(const vector<size_t> &idx, conditional_dat *cdat, ref
 		n = fam_ids_inc.size(),
 		i_size = idx.size();
 	double d_temp = 0.0;
-	eigenVector diagB(i_size),
-		x_i(n),
-		x_j(n);
+	eigenVector diagB(i_size);
 
 	cdat->B.resize(i_size, i_size);
 	cdat->B_N.resize(i_size, i_size);
@@ -617,16 +1109,13 @@ bool cond_analysis::init_b(const vector<size_t> &idx, conditional_dat *cdat, ref
 		cdat->B_N.insertBack(i, i) = cdat->D_N[i];
 
 		diagB[i] = msx_b[idx[i]];
-		makex_eigenVector(idx[i], x_i, false, ref);
 
 		for (j = i + 1; j < i_size; j++) {
 			if ((ref->bim_chr[to_include[idx[i]]] == ref->bim_chr[to_include[idx[j]]]
 					&& abs(ref->bim_bp[to_include[idx[i]]] - ref->bim_bp[to_include[idx[j]]]) < a_ld_window)
 				)
 			{
-				makex_eigenVector(idx[j], x_j, false, ref);
-
-				d_temp = x_i.dot(x_j) / (double)n;
+				d_temp = ld_cov(idx[i], idx[j]);
 				cdat->B.insertBack(j, i) = d_temp;
 				cdat->B_N.insertBack(j, i) = d_temp 
 									* min(nD[idx[i]], nD[idx[j]]) 
@@ -656,46 +1145,54 @@ bool cond_analysis::init_b(const vector<size_t> &idx, conditional_dat *cdat, ref
 
 void cond_analysis::init_z(const vector<size_t> &idx, conditional_dat *cdat, reference *ref)
 {
-	size_t i = 0, j = 0,
-		n = fam_ids_inc.size(),
-		m = to_include.size(),
+	size_t i = 0,
 		i_size = idx.size();
-	double d_temp = 0.0;
-	eigenVector x_i(n), x_j(n);
 
-	cdat->Z.resize(i_size, m);
-	cdat->Z_N.resize(i_size, m);
+	cdat->Z.resize(i_size);
+	cdat->Z_N.resize(i_size);
 
-	for (j = 0; j < m; j++) {
-		cdat->Z.startVec(j);
-		cdat->Z_N.startVec(j);
-
-		makex_eigenVector(j, x_j, false, ref);
-		for (i = 0; i < i_size; i++) {
-			if ((idx[i] != j 
-					&& ref->bim_chr[to_include[idx[i]]] == ref->bim_chr[to_include[j]]
-					&& abs(ref->bim_bp[to_include[idx[i]]] - ref->bim_bp[to_include[j]]) < a_ld_window)
-				)
-			{
-				makex_eigenVector(idx[i], x_i, false, ref);
+	for (i = 0; i < i_size; i++) {
+		make_z_row(idx[i], cdat->Z[i], cdat->Z_N[i], ref);
+	}
+	cdat->Z_ready = true;
+}
 
-				d_temp = x_j.dot(x_i) / (double)n;
-				cdat->Z.insertBack(i, j) = d_temp;
-				cdat->Z_N.insertBack(i, j) = d_temp
-										* min(nD[idx[i]], nD[j])
-										* sqrt(msx[idx[i]] * msx[j] / (msx_b[idx[i]] * msx_b[j]));
-			}
+/*
+ * Computes the row of Z and Z_N for the selected SNP at pos against every included SNP.
+ * Entries are only non-zero for SNPs on the same chromosome within the LD window.
+ */
+void cond_analysis::make_z_row(size_t pos, eigenSparseVec &z, eigenSparseVec &z_n, reference *ref)
+{
+	size_t j = 0,
+		m = to_include.size();
+	vector<size_t> window, slots;
+	vector<double> d;
+
+	for (j = 0; j < m; j++) {
+		if ((pos != j
+				&& ref->bim_chr[to_include[pos]] == ref->bim_chr[to_include[j]]
+				&& abs(ref->bim_bp[to_include[pos]] - ref->bim_bp[to_include[j]]) < a_ld_window)
+			)
+		{
+			window.push_back(j);
+			slots.push_back(ld_slot[j]);
 		}
 	}
-
-	cdat->Z.finalize();
-	cdat->Z_N.finalize();
+	ld->covariance(ld_slot[pos], slots, d);
+
+	z.resize(m);
+	z_n.resize(m);
+	for (size_t k = 0; k < window.size(); k++) {
+		j = window[k];
+		d[k] *= ld_sign[pos] * ld_sign[j];
+		z.insertBack(j) = d[k];
+		z_n.insertBack(j) = z_n_entry(pos, j, d[k]);
+	}
 }
 
-void cond_analysis::massoc_joint(const vector<size_t> &idx, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref)
+void cond_analysis::massoc_joint(const vector<size_t> &idx, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &chisqJ, reference *ref)
 {
 	size_t i = 0, n = idx.size();
-	double chisq = 0.0;
 	eigenVector b(n);
 	for (i = 0; i < n; i++)
 		b[i] = ja_beta[idx[i]];
@@ -707,18 +1204,14 @@ void cond_analysis::massoc_joint(const vector<size_t> &idx, conditional_dat *cda
 		}
 	}
 	
-	bJ.resize(n);
-	bJ_se.resize(n);
-	pJ.resize(n);
 	bJ = cdat->B_N_i * cdat->D_N.asDiagonal() * b;
 	bJ_se = cdat->B_N_i.diagonal();
-	pJ = eigenVector::Ones(n);
+	chisqJ = eigenVector::Zero(n);
 	bJ_se *= jma_Ve;
 	for (i = 0; i < n; i++) {
-		if (bJ_se[i] > 1.0e-30) {
+		if (cdat->B_N_i.coeff(i, i) * cdat->D_N[i] >= pivot_tol) {
 			bJ_se[i] = sqrt(bJ_se[i]);
-			chisq = bJ[i] / bJ_se[i];
-			pJ[i] = pchisq(chisq * chisq, 1.0);
+			chisqJ[i] = (bJ[i] / bJ_se[i]) * (bJ[i] / bJ_se[i]);
 		}
 		else {
 			bJ[i] = 0.0;
@@ -734,14 +1227,76 @@ void cond_analysis::massoc_joint(const vector<size_t> &idx, conditional_dat *cda
 void cond_analysis::find_independent_snps(conditional_dat *cdat, reference *ref)
 {
 	vector<size_t> selected, remain;
-	eigenVector bC, bC_se, pC;
+	eigenVector bC, bC_se, chisqC;
 	jma_snpnum_backward = 0;
+	jma_snpnum_collinear = 0;
+	jma_snpnum_prescreen = 0;
 
 	if (a_top_snp <= 0.0)
 		a_top_snp = 1e10;
 
 	spdlog::info("[{}] Performing stepwise model selection on {} SNPs; p cutoff = {}, collinearity = {} assuming complete LE between SNPs more than {} Mb away).", cname, to_include.size(), a_p_cutoff, a_collinear, a_ld_window / 1e6);
-	stepwise_select(selected, remain, cdat, bC, bC_se, pC, ref);
+	if (a_p_cutoff > 1e-3) {
+		spdlog::warn("P value level is too low for stepwise model.");
+	}
+
+	// Near-duplicates of a stronger SNP are left out of the selection; they are added
+	// back to the remaining SNPs afterwards so each is still conditioned for coloc
+	vector<char> is_rep(to_include.size(), 1);
+	collapsed.clear();
+	if (a_collapse_r2 > 0.0) {
+		collapse_duplicates(is_rep, ref);
+		spdlog::info("[{}] Collapsed {} SNPs in LD (r2 >= {}) with a stronger SNP; selecting from the remaining {}.", cname, collapsed.size(), a_collapse_r2, to_include.size() - collapsed.size());
+	}
+
+	// Blocks further apart than the LD window are independent, so these can be
+	// selected on in parallel. --top_snp caps the whole region so needs a single pass.
+	vector<vector<size_t>> blocks;
+	ld_blocks(blocks, ref);
+	if (!collapsed.empty()) {
+		for (auto &b : blocks)
+			b.erase(remove_if(b.begin(), b.end(), [&](size_t j) { return !is_rep[j]; }), b.end());
+		blocks.erase(remove_if(blocks.begin(), blocks.end(), [](const vector<size_t> &b) { return b.empty(); }), blocks.end());
+	}
+	bool single_pass = !(blocks.size() > 1 && a_top_snp >= to_include.size());
+	if (!single_pass) {
+		vector<vector<size_t>> part_sel(blocks.size()), part_rem(blocks.size());
+		vector<conditional_dat> parts(blocks.size());
+
+		spdlog::info("[{}] Running stepwise selection over {} independent LD blocks.", cname, blocks.size());
+#pragma omp parallel for schedule(dynamic)
+		for (int b = 0; b < blocks.size(); b++) {
+			eigenVector b_bC, b_bC_se, b_chisqC;
+			stepwise_select(blocks[b], part_sel[b], part_rem[b], &parts[b], b_bC, b_bC_se, b_chisqC, ref);
+		}
+		merge_blocks(blocks, part_sel, part_rem, parts, selected, remain, cdat, ref);
+
+		// The collinearity check of insert_B_Z is per SNP and so holds block by block, but its
+		// condition number check spans the whole selection. If the merged B fails it the
+		// blocked result may differ from a single pass, so the selection is redone in one.
+		if (!selected.empty()) {
+			SimplicialLDLT<eigenSparseMat> ldlt_B(cdat->B);
+			if (ldlt_B.vectorD().minCoeff() < 0 || sqrt(ldlt_B.vectorD().maxCoeff() / ldlt_B.vectorD().minCoeff()) > 30) {
+				spdlog::info("[{}] The SNPs selected over the LD blocks are ill-conditioned together; repeating the selection in a single pass.", cname);
+				*cdat = conditional_dat();
+				selected.clear();
+				remain.clear();
+				jma_snpnum_backward = 0;
+				jma_snpnum_collinear = 0;
+				jma_snpnum_prescreen = 0;
+				single_pass = true;
+			}
+		}
+	}
+	if (single_pass && !to_include.empty()) {
+		vector<size_t> all;
+		for (size_t j = 0; j < to_include.size(); j++) {
+			if (is_rep[j])
+				all.push_back(j);
+		}
+		stepwise_select(all, selected, remain, cdat, bC, bC_se, chisqC, ref);
+	}
+	spdlog::info("[{}] Finally, {} associated SNPs have been selected.", cname, selected.size());
 
 	if (selected.empty()) {
 		spdlog::warn("[{}] No SNPs have been selected by the step-wise selection algorithm. Using the unconditioned dataset.", cname);
@@ -754,6 +1309,18 @@ void cond_analysis::find_independent_snps(conditional_dat *cdat, reference *ref)
 	}
 
 	spdlog::info("[{}] ({} SNPs eliminated by backward selection.)", cname, jma_snpnum_backward);
+	spdlog::info("[{}] ({} SNPs rejected as collinear, {} of them by the prescreen.)", cname, jma_snpnum_collinear, jma_snpnum_prescreen);
+
+	// pw_conditional only reads the final state, so make sure it is complete here
+	if (cdat->B_N.cols() < 1 && !init_b(selected, cdat, ref))
+		spdlog::critical("There is a collinearity problem with the given list of SNPs.");
+	if (!cdat->Z_ready)
+		init_z(selected, cdat, ref);
+
+	if (!collapsed.empty()) {
+		remain.insert(remain.end(), collapsed.begin(), collapsed.end());
+		stable_sort(remain.begin(), remain.end());
+	}
 
 	num_ind_snps = selected.size();
 	ind_snps = selected;
@@ -763,80 +1330,86 @@ void cond_analysis::find_independent_snps(conditional_dat *cdat, reference *ref)
 /*
  * Run conditional analysis on marginal data for single association.
  */
-void cond_analysis::pw_conditional(int pos, bool out_cond, conditional_dat *cdat, reference *ref)
+void cond_analysis::pw_conditional(int pos, bool out_cond, const conditional_dat *cdat, cond_result *res, reference *ref)
 {
-	vector<size_t> selected(ind_snps), remain(remain_snps);
-	eigenVector bC, bC_se, pC;
-	size_t compare = selected[pos];
+	vector<size_t> selected(ind_snps), remain(remain_snps), rows(ind_snps.size());
+	eigenVector bC, bC_se, chisqC, pC;
+	eigenMatrix B_i(cdat->B_i), B_N_i(cdat->B_N_i);
+	eigenVector D_N(cdat->D_N);
 
-	// Move SNPs into the remain category
+	iota(rows.begin(), rows.end(), 0);
+
+	// Move the SNP into the remain category. Rather than rebuilding B for the other
+	// SNPs, their inverses are downdated from the final stepwise state in O(k^2).
 	if (pos >= 0) {
-		size_t i = 0;
-		for (i = 0; i < selected.size(); i++) {
-			if (selected[i] == compare) {
-				remain.push_back(selected[i]);
-				erase_B_and_Z(selected, selected[i], cdat);
-				selected.erase(selected.begin() + i);
-				break;
-			}
-		}
+		remain.push_back(selected[pos]);
+		B_i = drop_from_inverse(B_i, pos);
+		B_N_i = drop_from_inverse(B_N_i, pos);
+		D_N = drop_entry(D_N, pos);
+		selected.erase(selected.begin() + pos);
+		rows.erase(rows.begin() + pos);
 	}
 
-	massoc_conditional(selected, remain, cdat, bC, bC_se, pC, ref);
+	eigenVector b(selected.size());
+	for (size_t i = 0; i < selected.size(); i++)
+		b[i] = ja_beta[selected[i]];
+	eigenVector w = B_N_i * D_N.cwiseProduct(b);
+
+	massoc_conditional(selected, rows, remain, cdat, B_i, w, bC, bC_se, chisqC);
+	massoc_pval(chisqC, pC);
 	if (out_cond && pos > -1) {
 		sanitise_output(ind_snps, remain, pos, cdat, bC, bC_se, pC, ref);
 	}
 
-	// Save in friendly format for mdata class
-	snps_cond.clear();
-	b_cond.clear();
-	se_cond.clear();
-	maf_cond.clear();
-	p_cond.clear();
-	n_cond.clear();
-	if (ctype == coloc_type::COLOC_CC)
-		s_cond.clear();
-
-	/*
-	for (size_t i = 0; i < selected.size(); i++) {
-		size_t j = selected[i];
-		snps_cond.push_back(ref->bim_snp_name[to_include[j]]);
-		b_cond.push_back(ja_beta[j]);
-		se_cond.push_back(ja_beta_se[j]);
-		maf_cond.push_back(0.5 * mu[to_include[j]]);
-		p_cond.push_back(ja_pval[j]);
-		if (cond_ssize) {
-			n_cond.push_back(nD[j]);
-			if (ctype == coloc_type::COLOC_CC)
-				s_cond.push_back(ja_n_cases[j]);
-		}
-		else {
-			n_cond.push_back(nsample[j]);
-			if (ctype == coloc_type::COLOC_CC)
-				s_cond.push_back(ncases[j]);
-		}
+	// Save in friendly format for mdata class; the trait type and sample size mode are
+	// fixed for the analysis, so pick the specialised copy once
+	if (ctype == coloc_type::COLOC_CC) {
+		if (cond_ssize)
+			save_result<true, true>(remain, bC, bC_se, pC, res, ref);
+		else
+			save_result<true, false>(remain, bC, bC_se, pC, res, ref);
 	}
-	*/
+	else {
+		if (cond_ssize)
+			save_result<false, true>(remain, bC, bC_se, pC, res, ref);
+		else
+			save_result<false, false>(remain, bC, bC_se, pC, res, ref);
+	}
+}
 
-	for (size_t i = 0; i < remain.size(); i++) {
+/*
+ * Copies the conditioned statistics of the remain SNPs into res.
+ * @tparam case_control Whether the trait is case-control, so case counts are kept
+ * @tparam conditioned_n Whether to use the conditional sample sizes (--cond_ssize)
+ */
+template <bool case_control, bool conditioned_n>
+void cond_analysis::save_result(const vector<size_t> &remain, const eigenVector &bC, const eigenVector &bC_se, const eigenVector &pC, cond_result *res, reference *ref)
+{
+	size_t m = remain.size();
+
+	*res = cond_result();
+	res->ctype = ctype;
+	res->snps_cond.resize(m);
+	res->b_cond.resize(m);
+	res->se_cond.resize(m);
+	res->maf_cond.resize(m);
+	res->p_cond.resize(m);
+	res->n_cond.resize(m);
+	if (case_control)
+		res->s_cond.resize(m);
+
+	for (size_t i = 0; i < m; i++) {
 		size_t j = remain[i];
-		snps_cond.push_back(ref->bim_snp_name[to_include[j]]);
-		b_cond.push_back(bC[i]);
-		se_cond.push_back(bC_se[i]);
-		maf_cond.push_back(0.5 * mu[to_include[j]]);
-		p_cond.push_back(pC[i]);
-		if (cond_ssize) {
-			n_cond.push_back(nD[j]);
-			if (ctype == coloc_type::COLOC_CC)
-				s_cond.push_back(ja_n_cases[j]);
-		}
-		else {
-			n_cond.push_back(nsample[j]);
-			if (ctype == coloc_type::COLOC_CC)
-				s_cond.push_back(ncases[j]);
-		}
+		res->snps_cond[i] = ref->bim_snp_name[to_include[j]];
+		res->b_cond[i] = bC[i];
+		res->se_cond[i] = bC_se[i];
+		res->maf_cond[i] = 0.5 * mu[to_include[j]];
+		res->p_cond[i] = pC[i];
+		res->n_cond[i] = conditioned_n ? nD[j] : nsample[j];
+		if (case_control)
+			res->s_cond[i] = conditioned_n ? ja_n_cases[j] : ncases[j];
 	}
-	cond_passed = bC.size() > 0;
+	res->passed = bC.size() > 0;
 }
 
 /*
@@ -866,17 +1439,14 @@ void cond_analysis::LD_rval(const vector<size_t> &idx, eigenMatrix &rval, condit
  */
 void cond_analysis::LD_rval(const vector<size_t> &v1, const vector<size_t> &v2, eigenMatrix &rval, reference *ref)
 {
-	size_t i = 0, j = 0, k = 0,
-		n = fam_ids_inc.size(),
+	size_t i = 0, j = 0,
 		v1_size = v1.size(),
 		v2_size = v2.size();
-	double d_temp = 0.0;
-	eigenVector x_i(n),
-		x_j(n);
-	eigenMatrix B_ld(v1_size, v2_size);
+	eigenMatrix B_ld = eigenMatrix::Zero(v1_size, v2_size);
 
 	for (i = 0; i < v1_size; i++) {
-		makex_eigenVector(v1[i], x_i, false, ref);
+		vector<size_t> window, slots;
+		vector<double> d;
 
 		for (j = 0; j < v2_size; j++) {
 			if (v1[i] == v2[j]) {
@@ -888,13 +1458,14 @@ void cond_analysis::LD_rval(const vector<size_t> &v1, const vector<size_t> &v2,
 				&& abs(ref->bim_bp[to_include[v1[i]]] - ref->bim_bp[to_include[v2[j]]]) < a_ld_window)
 				)
 			{
-				makex_eigenVector(v2[j], x_j, false, ref);
-				B_ld(i, j) = x_i.dot(x_j) / (double)n;
-			}
-			else {
-				B_ld(i, j) = 0;
+				window.push_back(j);
+				slots.push_back(ld_slot[v2[j]]);
 			}
 		}
+
+		ld->covariance(ld_slot[v1[i]], slots, d);
+		for (size_t k = 0; k < window.size(); k++)
+			B_ld(i, window[k]) = ld_sign[v1[i]] * ld_sign[v2[window[k]]] * d[k];
 	}
 
 	eigenVector sd_v1(v1_size), sd_v2(v2_size);
@@ -912,7 +1483,7 @@ void cond_analysis::LD_rval(const vector<size_t> &v1, const vector<size_t> &v2,
 	}
 }
 
-void cond_analysis::sanitise_output(vector<size_t> &selected, vector<size_t> &remain, int pos, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref)
+void cond_analysis::sanitise_output(vector<size_t> &selected, vector<size_t> &remain, int pos, const conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref)
 {
 	string filename;
 	size_t i = 0, j = 0, k;
@@ -997,18 +1568,18 @@ void cond_analysis::locus_plot(char *filename, char *datafile, char *to_save, ch
 /*
  * Initialise matched data class from two conditional analyses
  */
-mdata::mdata(cond_analysis *ca1, cond_analysis *ca2)
+mdata::mdata(const cond_result *ca1, const cond_result *ca2)
 {
-	if (!ca1->coloc_ready() || !ca2->coloc_ready()) {
+	if (!ca1->passed || !ca2->passed) {
 		return; // TODO Handle me
 	}
 
 	size_t n = ca1->snps_cond.size();
-	vector<string>::iterator it;
+	vector<string>::const_iterator it;
 
 	// Match SNPs
 	for (it = ca1->snps_cond.begin(); it != ca1->snps_cond.end(); it++) {
-		vector<string>::iterator it2;
+		vector<string>::const_iterator it2;
 		if ((it2 = find(ca2->snps_cond.begin(), ca2->snps_cond.end(), *it)) != ca2->snps_cond.end()) 
 		{
 			size_t dist1 = distance(ca1->snps_cond.begin(), it),
@@ -1030,9 +1601,6 @@ mdata::mdata(cond_analysis *ca1, cond_analysis *ca2)
 		pvals1.push_back(ca1->p_cond[itmap->first]);
 		mafs1.push_back(ca1->maf_cond[itmap->first]);
 		ns1.push_back(ca1->n_cond[itmap->first]);
-		if (ca1->get_coloc_type() == coloc_type::COLOC_CC) {
-			s1.push_back(ca1->s_cond[itmap->first]);
-		}
 
 		snps2.push_back(ca2->snps_cond[itmap->second]);
 		betas2.push_back(ca2->b_cond[itmap->second]);
@@ -1040,30 +1608,37 @@ mdata::mdata(cond_analysis *ca1, cond_analysis *ca2)
 		pvals2.push_back(ca2->p_cond[itmap->second]);
 		mafs2.push_back(ca2->maf_cond[itmap->second]);
 		ns2.push_back(ca2->n_cond[itmap->second]);
-		if (ca2->get_coloc_type() == coloc_type::COLOC_CC) {
-			s2.push_back(ca2->s_cond[itmap->second]);
-		}
 
 		itmap++;
 	}
 
-	type1 = ca1->get_coloc_type();
-	type2 = ca2->get_coloc_type();
+	// Case counts only exist for case-control traits
+	if (ca1->ctype == coloc_type::COLOC_CC) {
+		for (auto &p : snp_map)
+			s1.push_back(ca1->s_cond[p.first]);
+	}
+	if (ca2->ctype == coloc_type::COLOC_CC) {
+		for (auto &p : snp_map)
+			s2.push_back(ca2->s_cond[p.second]);
+	}
+
+	type1 = ca1->ctype;
+	type2 = ca2->ctype;
 }
 
 /*
  * Initialise matched data class from one conditional analysis and one phenotype
  */
-mdata::mdata(cond_analysis *ca, phenotype *ph)
+mdata::mdata(const cond_result *ca, phenotype *ph)
 {
 	vector<string> pheno_snps = ph->get_snp_names();
-	if (!ca->coloc_ready()) {
+	if (!ca->passed) {
 		return; // TODO Handle me
 	}
 
 	// Match SNPs
 	for (auto i : ph->matched_idx) {
-		vector<string>::iterator it;
+		vector<string>::const_iterator it;
 		string snp_to_find = pheno_snps[i];
 
 		if ((it = find(ca->snps_cond.begin(), ca->snps_cond.end(), snp_to_find)) != ca->snps_cond.end()) 
@@ -1086,9 +1661,6 @@ mdata::mdata(cond_analysis *ca, phenotype *ph)
 		pvals1.push_back(ca->p_cond[itmap->first]);
 		mafs1.push_back(ca->maf_cond[itmap->first]);
 		ns1.push_back(ca->n_cond[itmap->first]);
-		if (ca->get_coloc_type() == coloc_type::COLOC_CC) {
-			s1.push_back(ca->s_cond[itmap->first]);
-		}
 
 		snps2.push_back(ph->snp_name[itmap->second]);
 		betas2.push_back(ph->beta[itmap->second]);
@@ -1096,13 +1668,20 @@ mdata::mdata(cond_analysis *ca, phenotype *ph)
 		pvals2.push_back(ph->pval[itmap->second]);
 		mafs2.push_back(ph->freq[itmap->second]);
 		ns2.push_back(ph->n[itmap->second]);
-		if (ph->get_coloc_type() == coloc_type::COLOC_CC) {
-			s2.push_back(ph->n_case[itmap->second]);
-		}
 
 		itmap++;
 	}
 
-	type1 = ca->get_coloc_type();
+	// Case counts only exist for case-control traits
+	if (ca->ctype == coloc_type::COLOC_CC) {
+		for (auto &p : snp_map)
+			s1.push_back(ca->s_cond[p.first]);
+	}
+	if (ph->get_coloc_type() == coloc_type::COLOC_CC) {
+		for (auto &p : snp_map)
+			s2.push_back(ph->n_case[p.second]);
+	}
+
+	type1 = ca->ctype;
 	type2 = ph->get_coloc_type();
 }
@@ -3,7 +3,9 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <numeric>
 #include <omp.h>
+#include <queue>
 #include <string>
 #include <sys/stat.h>
 
@@ -13,33 +15,38 @@
 
 #include "data.h"
 #include "helper_funcs.h"
+#include "locus_ld.h"
 
 #ifdef PYTHON_INC
 #include <Python.h>
 #endif
 
-#ifdef SINGLE_PRECISION
-typedef Eigen::SparseMatrix<float, Eigen::ColMajor, long long> eigenSparseMat;
-#else
+// With MIXED_PRECISION the Z rows, which hold the LD between each selected SNP and every
+// other SNP, are stored in float. B, its inverse and the statistics derived from them are
+// small and kept in double. --precision_check reruns the analyses with exact_z set.
 typedef Eigen::SparseMatrix<double, Eigen::ColMajor, long long> eigenSparseMat;
+#ifdef MIXED_PRECISION
+typedef Eigen::SparseVector<float, Eigen::ColMajor, long long> eigenSparseVec;
+#else
+typedef Eigen::SparseVector<double, Eigen::ColMajor, long long> eigenSparseVec;
 #endif
 
 EIGEN_DEFINE_STL_VECTOR_SPECIALIZATION(eigenSparseMat);
 using namespace Eigen;
 using namespace std;
 
-#ifdef SINGLE_PRECISION
-typedef DiagonalMatrix<float, Dynamic, Dynamic> eigenDiagMat;
-typedef MatrixXf eigenMatrix;
-typedef VectorXf eigenVector;
-typedef DynamicSparseMatrix<float> eigenDynSparseMat;
-#else
 typedef DiagonalMatrix<double, Dynamic, Dynamic> eigenDiagMat;
 typedef MatrixXd eigenMatrix;
 typedef VectorXd eigenVector;
 typedef DynamicSparseMatrix<double> eigenDynSparseMat;
-#endif
 
+// Largest statistic first; ties go to the earlier SNP
+struct step_order {
+	bool operator()(const pair<double, size_t> &a, const pair<double, size_t> &b) const {
+		return a.first < b.first || (a.first == b.first && a.second > b.second);
+	}
+};
+typedef priority_queue<pair<double, size_t>, vector<pair<double, size_t>>, step_order> step_queue_t;
 
 enum cond_type {
 	CO_COND = 0,
@@ -52,22 +59,54 @@ struct conditional_dat {
 	eigenSparseMat B_N;
 	eigenSparseMat B_N_i; // Identity matrix of B_N
 	eigenVector D_N;
-	eigenSparseMat Z;
-	eigenSparseMat Z_N;
+	// Z and Z_N are kept as one sparse row per selected SNP (in the same order as B)
+	// so that selecting or dropping a SNP only touches that SNP's row
+	vector<eigenSparseVec> Z;
+	vector<eigenSparseVec> Z_N;
+	bool Z_ready; // Z rows have been initialised by init_z
+
+	// Stepwise selection cache, indexed by position in step_snps so that a selection over
+	// one LD block only holds statistics for that block
+	bool step_cache_ready; // Cached conditional statistics are valid for the current selection
+	vector<size_t> step_snps; // Candidates of the selection in ascending order
+	eigenVector step_bC;
+	eigenVector step_bC_se;
+	eigenVector step_chisq;
+	vector<char> step_remain; // SNP is still a candidate for selection
+	vector<size_t> step_dirty; // SNPs whose conditional statistics need recomputing
+	step_queue_t step_queue; // Heap of (chisq, SNP); entries are lazily discarded once stale
+
+	// Position of SNP j in step_snps, or step_snps.size() if it is not a candidate
+	size_t step_pos(size_t j) const {
+		auto it = lower_bound(step_snps.begin(), step_snps.end(), j);
+		return it != step_snps.end() && *it == j ? it - step_snps.begin() : step_snps.size();
+	}
 
 	// Initialiser
-	conditional_dat() : B{ 0, 0 }, B_i{ 0, 0 }, B_N{ 0, 0 }, B_N_i{ 0, 0 }, D_N(0), Z{ 0, 0 }, Z_N{ 0, 0 } {}; // TODO All will be resized later which may be inefficient
+	conditional_dat() : B{ 0, 0 }, B_i{ 0, 0 }, B_N{ 0, 0 }, B_N_i{ 0, 0 }, D_N(0), Z_ready(false), step_cache_ready(false) {}; // TODO All will be resized later which may be inefficient
+};
+
+// Conditioned data for one independent SNP, as passed on to coloc. Each is computed once
+// by pw_conditional and only read afterwards.
+struct cond_result {
+	vector<string> snps_cond; /// SNP names
+	vector<double> b_cond; /// Beta
+	vector<double> se_cond; /// SE(beta)
+	vector<double> maf_cond; /// Minor allele frequency
+	vector<double> p_cond; /// P values
+	vector<double> n_cond; /// Sample sizes
+	vector<double> s_cond; /// Cases for case-control (TODO probably needs conditioned)
+	coloc_type ctype; // Type of coloc to use: cc or quant
+	bool passed; // Ready for coloc after conditional analysis
+
+	cond_result() : ctype(coloc_type::COLOC_NONE), passed(false) {};
 };
 
 class cond_analysis {
 public:
-	cond_analysis(double p_cutoff, double collinear, double ld_window, string out, double top_snp, double freq_thres, string name, bool cond_ssize, bool verbose);
+	cond_analysis(double p_cutoff, double collinear, double collapse_r2, double ld_window, string out, double top_snp, double freq_thres, string name, bool cond_ssize, bool verbose);
 	cond_analysis();
 
-	bool coloc_ready() {
-		return cond_passed;
-	}
-
 	string get_cond_name() {
 		return cname;
 	}
@@ -90,37 +129,47 @@ public:
 		return ctype;
 	}
 
-	void init_conditional(phenotype *pheno, reference *ref);
-	void find_independent_snps(conditional_dat *cdat, reference *ref);
-	void pw_conditional(int pos, bool out_cond, conditional_dat *cdat, reference *ref);
+	void set_exact_z(bool exact_z) {
+		this->exact_z = exact_z;
+	}
 
-	// For coloc
-	vector<string> snps_cond; /// SNP names
-	vector<double> b_cond; /// Beta
-	vector<double> se_cond; /// SE(beta)
-	vector<double> maf_cond; /// Minor allele frequency
-	vector<double> p_cond; /// P values
-	vector<double> n_cond; /// Sample sizes
-	vector<double> s_cond; /// Cases for case-control (TODO probably needs conditioned)
+	void init_conditional(phenotype *pheno, reference *ref, locus_ld *ld);
+	void find_independent_snps(conditional_dat *cdat, reference *ref);
+	void pw_conditional(int pos, bool out_cond, const conditional_dat *cdat, cond_result *res, reference *ref);
 
 private:
+	friend struct cond_analysis_test; /// Tests reach the steps of the selection directly
+
 	void match_gwas_phenotype(phenotype *pheno, reference *ref);
 
-	void makex_eigenVector(size_t j, eigenVector &x, bool resize, reference *ref);
+	double ld_cov(size_t i, size_t j);
+	double z_n_entry(size_t i, size_t j, double cov);
 	bool init_b(const vector<size_t> &idx, conditional_dat *cdat, reference *ref);
 	void init_z(const vector<size_t> &idx, conditional_dat *cdat, reference *ref);
+	void make_z_row(size_t pos, eigenSparseVec &z, eigenSparseVec &z_n, reference *ref);
+	bool collinear_prescreen(const vector<size_t> &selected, size_t pos, conditional_dat *cdat);
 	bool insert_B_Z(const vector<size_t> &idx, size_t pos, conditional_dat *cdat, reference *ref);
-	void erase_B_and_Z(const vector<size_t> &idx, size_t erase, conditional_dat *cdat);
-	void stepwise_select(vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &pC, reference *ref);
-
-	bool select_entry(vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &pC, reference *ref);
-	void selected_stay(vector<size_t> &select, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref);
-	void massoc_conditional(const vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &pC, reference *ref);
-	void massoc_joint(const vector<size_t> &idx, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref);
+	void compact_B_and_Z(vector<size_t> &idx, const vector<char> &keep, conditional_dat *cdat, const eigenMatrix *B_i, const eigenMatrix *B_N_i);
+	void ld_blocks(vector<vector<size_t>> &blocks, reference *ref);
+	void collapse_duplicates(vector<char> &is_rep, reference *ref);
+	void merge_blocks(const vector<vector<size_t>> &blocks, vector<vector<size_t>> &part_sel, vector<vector<size_t>> &part_rem, vector<conditional_dat> &parts,
+		vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, reference *ref);
+	void stepwise_select(const vector<size_t> &candidates, vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC, reference *ref);
+
+	bool select_entry(vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC, reference *ref);
+	void mark_dirty(const vector<size_t> &selected, size_t pos, conditional_dat *cdat);
+	void selected_stay(vector<size_t> &select, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &chisqJ, reference *ref);
+	void massoc_conditional(const vector<size_t> &selected, vector<size_t> &remain, conditional_dat *cdat, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC, reference *ref);
+	void massoc_conditional(const vector<size_t> &selected, const vector<size_t> &rows, const vector<size_t> &remain, const conditional_dat *cdat,
+		const eigenMatrix &B_i, const eigenVector &w, eigenVector &bC, eigenVector &bC_se, eigenVector &chisqC);
+	void massoc_joint(const vector<size_t> &idx, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &chisqJ, reference *ref);
+	void massoc_pval(const eigenVector &chisq, eigenVector &pval);
 
 	void LD_rval(const vector<size_t> &idx, eigenMatrix &rval, conditional_dat *cdat);
 	void LD_rval(const vector<size_t> &v1, const vector<size_t> &v2, eigenMatrix &rval, reference *ref);
-	void sanitise_output(vector<size_t> &selected, vector<size_t> &remain, int pos, conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref);
+	template <bool case_control, bool conditioned_n>
+	void save_result(const vector<size_t> &remain, const eigenVector &bC, const eigenVector &bC_se, const eigenVector &pC, cond_result *res, reference *ref);
+	void sanitise_output(vector<size_t> &selected, vector<size_t> &remain, int pos, const conditional_dat *cdat, eigenVector &bJ, eigenVector &bJ_se, eigenVector &pJ, reference *ref);
 	void locus_plot(char *filename, char *datafile, char *to_save, char *snpname, double bp, double p, double pC);
 
 	double a_ld_window; // Distance in kb after which SNPs are considered to be in LD
@@ -130,7 +179,10 @@ private:
 
 	// Joint analysis related
 	double a_collinear; // Collinearity check between SNPs
+	double a_collapse_r2; /// SNPs in LD above this with a stronger SNP are left out of the selection; 0 to disable
+	vector<size_t> collapsed; /// SNPs represented by another SNP during the selection
 	int jma_snpnum_collinear;
+	int jma_snpnum_prescreen; /// Collinear candidates rejected before rebuilding B
 	int jma_snpnum_backward;
 	vector<string> ja_snp_name;
 	eigenVector ja_freq;
@@ -145,6 +197,11 @@ private:
 	eigenVector msx_b; 
 	eigenVector nD;
 
+	locus_ld *ld; /// Genotype LD shared with the other analyses at this locus
+	vector<size_t> ld_slot; /// Slot of each SNP in ld
+	vector<double> ld_sign; /// +1 if the SNP is coded on the bim A1 allele, -1 if flipped
+	bool exact_z; /// Take Z entries from ld in double, using the Z rows only for where they are non-zero
+
 	bool cond_ssize; /// Whether to use conditional sample sizes or not
 	vector<double> nsample; /// Note that this is not conditioned like nD
 	vector<double> ncases; /// Note that this is not conditioned like nD
@@ -154,6 +211,7 @@ private:
 	string a_out;
 	double a_top_snp;
 	double a_p_cutoff;
+	double a_chisq_cutoff; /// Chi-square statistic equivalent to a_p_cutoff
 	double a_freq_threshold;
 	int num_snps;
 	bool verbose;
@@ -167,7 +225,6 @@ private:
 	double jma_Vp; /// Phenotypic variance
 
 	vector<size_t> remain_snps; // Remainder of SNPs after the stepwise selection process
-	bool cond_passed; // Ready for coloc after conditional analysis
 	vector<double> mu; // Calculated allele frequencies using fam data
 
 	// Coloc related
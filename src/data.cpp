@@ -468,27 +468,14 @@ int reference::read_bimfile(string bimfile)
  */
 void reference::match_bim(vector<string> &names, vector<string> &names2, bool keep_frequencies)
 {
-	// Temporary containers
-	vector<string> bim_snp_name_t,
-		bim_allele1_t,
-		bim_allele2_t;
-	vector<unsigned short> bim_chr_t;
-	vector<int> bim_bp_t;
-	//vector<double> bim_genet_dst_t;
-	vector<signed long> r_positions, // Read positions in bim vectors
-		og_positions; // Original position in the bim file
-	vector<double> mu_t;
-	vector<vector<bool>> snp_1_t, snp_2_t;
-	vector<size_t> r_positions_t, og_positions_t;
 	vector<string> snp_names = names;
+	vector<signed long> r_positions; // Read positions in bim vectors
 	
 	copy(names2.begin(), names2.end(), back_inserter(snp_names));
 	v_remove_dupes(snp_names);
 
 	r_positions.resize(snp_names.size());
-	og_positions.resize(snp_names.size());
 	fill(r_positions.begin(), r_positions.end(), -1);
-	fill(og_positions.begin(), og_positions.end(), -1);
 
 #pragma omp parallel for
 	for (int i = 0; i < snp_names.size(); ++i) {
@@ -496,31 +483,82 @@ void reference::match_bim(vector<string> &names, vector<string> &names2, bool ke
 		if ((it = find(bim_snp_name.begin(), bim_snp_name.end(), snp_names[i])) == bim_snp_name.end())
 			continue;
 		r_positions[i] = it - bim_snp_name.begin();
-		og_positions[i] = bim_og_pos[it - bim_snp_name.begin()];
 	}
 
+	take_snps(*this, r_positions, keep_frequencies);
+}
+
+/*
+ * Matches the SNPs of a pair against a reference that has been read whole (see whole_bim),
+ * which is left untouched so that several pairs can be matched against it at the same time.
+ * The individuals, SNP information, genotypes and frequencies of the matched SNPs are
+ * copied into this reference.
+ * @param reference panel Whole reference that has been through sanitise_list
+ * @ret void
+ */
+void reference::match_bim(const reference &panel, vector<string> &names, vector<string> &names2)
+{
+	vector<string> snp_names = names;
+	vector<signed long> r_positions;
+
+	individuals = panel.individuals;
+	fam_ids_inc = panel.fam_ids_inc;
+	num_snps = panel.num_snps;
+	start_snps = panel.start_snps;
+	end_snps = panel.end_snps;
+
+	copy(names2.begin(), names2.end(), back_inserter(snp_names));
+	v_remove_dupes(snp_names);
+
+	r_positions.resize(snp_names.size());
+	for (size_t i = 0; i < snp_names.size(); i++) {
+		auto it = panel.snp_map.find(snp_names[i]);
+		r_positions[i] = it == panel.snp_map.end() ? -1 : (signed long)it->second;
+	}
+
+	take_snps(panel, r_positions, true);
+}
+
+/*
+ * Keeps the SNPs of src at the given read positions (-1 if not in the reference), which
+ * may be this reference itself.
+ * @ret void
+ */
+void reference::take_snps(const reference &src, const vector<signed long> &r_positions, bool keep_frequencies)
+{
+	// Temporary containers
+	vector<string> bim_snp_name_t,
+		bim_allele1_t,
+		bim_allele2_t;
+	vector<unsigned short> bim_chr_t;
+	vector<int> bim_bp_t;
+	//vector<double> bim_genet_dst_t;
+	vector<double> mu_t;
+	vector<vector<bool>> snp_1_t, snp_2_t;
+	vector<size_t> r_positions_t, og_positions_t;
+
 	// Remove from map if -1
 	for (size_t j = 0; j < r_positions.size(); j++) {
 		if (r_positions[j] != -1) {
 			r_positions_t.push_back(r_positions[j]);
-			og_positions_t.push_back(og_positions[j]);
+			og_positions_t.push_back(src.bim_og_pos[r_positions[j]]);
 		}
 	}
 	bim_read_pos = r_positions_t;
 	bim_og_pos = og_positions_t;
 
 	for (size_t j = 0; j < bim_read_pos.size(); j++) {
-		bim_snp_name_t.push_back(bim_snp_name[bim_read_pos[j]]);
-		bim_allele1_t.push_back(bim_allele1[bim_read_pos[j]]);
-		bim_allele2_t.push_back(bim_allele2[bim_read_pos[j]]);
-		bim_chr_t.push_back(bim_chr[bim_read_pos[j]]);
-		bim_bp_t.push_back(bim_bp[bim_read_pos[j]]);
+		bim_snp_name_t.push_back(src.bim_snp_name[bim_read_pos[j]]);
+		bim_allele1_t.push_back(src.bim_allele1[bim_read_pos[j]]);
+		bim_allele2_t.push_back(src.bim_allele2[bim_read_pos[j]]);
+		bim_chr_t.push_back(src.bim_chr[bim_read_pos[j]]);
+		bim_bp_t.push_back(src.bim_bp[bim_read_pos[j]]);
 		//bim_genet_dst_t.push_back(bim_genet_dst[bim_read_pos[j]]);
 
 		if (keep_frequencies) {
-			snp_1_t.push_back(bed_snp_1[bim_read_pos[j]]);
-			snp_2_t.push_back(bed_snp_2[bim_read_pos[j]]);
-			mu_t.push_back(mu[bim_read_pos[j]]);
+			snp_1_t.push_back(src.bed_snp_1[bim_read_pos[j]]);
+			snp_2_t.push_back(src.bed_snp_2[bim_read_pos[j]]);
+			mu_t.push_back(src.mu[bim_read_pos[j]]);
 		}
 	}
 	bim_snp_name.swap(bim_snp_name_t);
@@ -808,6 +846,16 @@ void reference::get_read_individuals(vector<int> &read_individuals)
 	}
 }
 
+/*
+ * Splits a packed .bed row into the 2-bit genotype code of each individual.
+ */
+HOT_KERNEL
+static void bed_decode_kernel(const char *buf, size_t individuals, unsigned char *codes)
+{
+	for (size_t j = 0; j < individuals; j++)
+		codes[j] = ((unsigned char)buf[j >> 2] >> ((j & 3) << 1)) & 3;
+}
+
 /* 
  * Sub-function that work asynchronously to read the .bed buffer for faster
  * reading.
@@ -817,44 +865,35 @@ void reference::get_read_individuals(vector<int> &read_individuals)
  * @param vector<int> read_individuals Which samples have been read and included.
  * @ret void
  */
-void reference::parse_bed_data(char *buf, size_t snp_idx, vector<int> read_individuals)
+void reference::parse_bed_data(char *buf, size_t snp_idx, const vector<int> &read_individuals)
 {
-	size_t j, k,
-		m = fam_ids_inc.size(),
+	size_t j,
 		ind_idx;
-	int buf_count = 0;
-	bitset<8> b;
 	double fcount = 0;
+	bool flip = bim_allele2[snp_idx] == ref_A[snp_idx];
+	vector<unsigned char> codes(individuals);
 
-	for (j = 0, ind_idx = 0; j < individuals; )
-	{
-		b = buf[buf_count];
-		buf_count++;
-		k = 0;
-		while (k < 7 && j < individuals) { // 11 for AA; 00 for BB
-			if (read_individuals[j] == 0) {
-				k += 2;
-			}
-			else {
-				double b2 = (!b[k++]) ? 1.0 : 0.0, // This order is important
-					b1 = (!b[k++]) ? 1.0 : 0.0;
-				snp_2[snp_idx][ind_idx] = (bool)b2;
-				snp_1[snp_idx][ind_idx] = (bool)b1;
-
-				// Frequency
-				if (!b1 || b2) { // i.e. no missing genotype (coded as "10")
-					double f = b1 + b2;
-					if (bim_allele2[snp_idx] == ref_A[snp_idx]) {
-						f = 2.0 - f;
-					}
-					mu[snp_idx] += f;
-					fcount += 1.0;
-				}
+	bed_decode_kernel(buf, individuals, codes.data());
+	for (j = 0, ind_idx = 0; j < individuals; j++) { // 11 for AA; 00 for BB
+		if (read_individuals[j] == 0)
+			continue;
+
+		double b2 = (codes[j] & 1) ? 0.0 : 1.0, // This order is important
+			b1 = (codes[j] & 2) ? 0.0 : 1.0;
+		snp_2[snp_idx][ind_idx] = (bool)b2;
+		snp_1[snp_idx][ind_idx] = (bool)b1;
 
-				ind_idx++;
+		// Frequency
+		if (!b1 || b2) { // i.e. no missing genotype (coded as "10")
+			double f = b1 + b2;
+			if (flip) {
+				f = 2.0 - f;
 			}
-			j++;
+			mu[snp_idx] += f;
+			fcount += 1.0;
 		}
+
+		ind_idx++;
 	}
 
 	if (fcount > 0)
@@ -944,6 +983,64 @@ int reference::read_bedfile(string bedfile)
 	return 1;
 }
 
+/*
+ * Sets up the reference from the SNP information of a precomputed LD matrix, which takes
+ * the place of reading the .bim, .fam and .bed files. No genotypes are held.
+ * @param vector<double> freq Frequency of allele1
+ * @param size_t n Sample size the LD was estimated from
+ * @ret void
+ */
+void reference::set_snp_info(const vector<string> &names, const vector<unsigned short> &chr, const vector<int> &bp, const vector<string> &allele1,
+	const vector<string> &allele2, const vector<double> &freq, size_t n)
+{
+	size_t i = 0, pos = 0;
+
+	bim_clear();
+	bim_read_pos.clear();
+	bim_og_pos.clear();
+	mu.clear();
+	start_snps = end_snps = -1;
+
+	for (pos = 0; pos < names.size(); pos++) {
+		if (chr[pos] == 0 || (a_chr > 0 && chr[pos] != a_chr))
+			continue;
+
+		if (start_snps == -1)
+			start_snps = pos;
+
+		bim_chr.push_back(chr[pos]);
+		bim_snp_name.push_back(names[pos]);
+		bim_bp.push_back(bp[pos]);
+		bim_allele1.push_back(allele1[pos]);
+		bim_allele2.push_back(allele2[pos]);
+		bim_read_pos.push_back(i++);
+		bim_og_pos.push_back(pos);
+		mu.push_back(2.0 * freq[pos]);
+		end_snps = pos;
+	}
+
+	num_snps = i;
+	ref_A = bim_allele1;
+	other_A = bim_allele2;
+
+	// Stand-ins for the genotype data so the matching steps work unchanged
+	bed_snp_1.assign(num_snps, vector<bool>());
+	bed_snp_2.assign(num_snps, vector<bool>());
+	bed_snp_1_m = bed_snp_1;
+	bed_snp_2_m = bed_snp_2;
+	mu_m = mu;
+
+	individuals = n;
+	fam_ids_inc.resize(individuals);
+	iota(fam_ids_inc.begin(), fam_ids_inc.end(), 0);
+
+	spdlog::info("Number of SNPs taken from the LD matrix: {}.", num_snps);
+	if (individuals < 4000) {
+		spdlog::warn("Sample size for the reference panel is below the recommended size of 4000!");
+		spdlog::warn("Continuing analysis, but please consider using a larger reference panel.");
+	}
+}
+
 /*
  * Updates the inclusion list of SNPs based on an index-based vector.
  * @param const vector<size_t> idx Index of SNPs
@@ -30,7 +30,7 @@ enum class coloc_type : int {
 	COLOC_CC,
 };
 
-class cond_analysis;
+struct cond_result;
 
 class phenotype {
 public:
@@ -92,8 +92,8 @@ phenotype *init_pheno(string filename, string pheno_name, double n, double n_cas
 class mdata {
 public:
 	mdata(phenotype *ph1, phenotype *ph2);
-	mdata(cond_analysis *ca1, cond_analysis *ca2);
-	mdata(cond_analysis *ca, phenotype *ph);
+	mdata(const cond_result *ca1, const cond_result *ca2);
+	mdata(const cond_result *ca, phenotype *ph);
 	mdata();
 
 	vector<string> &get_snp_list() {
@@ -115,7 +115,11 @@ private:
 	map<size_t, size_t> snp_map; // Positions of SNPs in original datasets
 };
 
+class shared_reference;
+
 class reference {
+	friend class shared_reference;
+
 public:
 	reference(string out, unsigned short chr);
 	reference();
@@ -124,10 +128,13 @@ public:
 	int read_bimfile(string bimfile);
 	int read_famfile(string famfile);
 	int read_bedfile(string bedfile);
-	void parse_bed_data(char *buf, size_t i, vector<int> read_individuals);
+	void set_snp_info(const vector<string> &names, const vector<unsigned short> &chr, const vector<int> &bp, const vector<string> &allele1,
+		const vector<string> &allele2, const vector<double> &freq, size_t n);
+	void parse_bed_data(char *buf, size_t i, const vector<int> &read_individuals);
 	void bim_clear();
 	void fam_clear();
 	void match_bim(vector<string> &names, vector<string> &names2, bool keep_frequencies);
+	void match_bim(const reference &panel, vector<string> &names, vector<string> &names2);
 	void whole_bim();
 	void reset_vectors();
 
@@ -177,6 +184,8 @@ public:
 	vector<vector<bool>> bed_snp_2;
 
 private:
+	void take_snps(const reference &src, const vector<signed long> &r_positions, bool keep_frequencies);
+
 	string a_out;
 	unsigned short a_chr;
 	bool failed; // Reference files failed to read in some way
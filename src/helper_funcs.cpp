@@ -57,6 +57,124 @@ double pchisq(double x, double df)
 	return q;
 }
 
+/*
+ * Upper tail of the chi-square distribution with one degree of freedom,
+ * P(X > x) = erfc(sqrt(x / 2)). Accurate down to the smallest normal doubles
+ * (x of roughly 1400) without going through the general cdfchi search.
+ * @param double x Chi-square statistic
+ * @ret double P value, or -9 if x is negative (as pchisq)
+ */
+double pchisq1(double x)
+{
+	if (x < 0)
+		return -9;
+	return std::erfc(std::sqrt(0.5 * x));
+}
+
+/*
+ * Batch version of pchisq1 over n statistics, so callers convert a whole column in one
+ * call. Each element is still one libm erfc call; the values are identical to pchisq1.
+ * @param const double *x Chi-square statistics
+ * @param double *p Output P values
+ * @param size_t n Number of statistics
+ * @ret void
+ */
+void pchisq1(const double *x, double *p, std::size_t n)
+{
+	for (std::size_t i = 0; i < n; i++)
+		p[i] = pchisq1(x[i]);
+}
+
+/*
+ * Dot product of two vectors. Products are summed into a fixed number of lanes that are
+ * combined in a fixed order, so every instruction set gives the same result.
+ * @ret double Sum of a[i] * b[i]
+ */
+HOT_KERNEL
+double dot_kernel(const double *a, const double *b, std::size_t n)
+{
+	const std::size_t lanes = 8;
+	double lane[lanes] = { 0.0 }, d = 0.0;
+	std::size_t i = 0, l;
+
+	for (; i + lanes <= n; i += lanes) {
+		for (l = 0; l < lanes; l++)
+			lane[l] += a[i + l] * b[i + l];
+	}
+	for (; i < n; i++)
+		d += a[i] * b[i];
+	for (l = 0; l < lanes; l++)
+		d += lane[l];
+	return d;
+}
+
+/*
+ * Name of the kernel variant picked for this CPU, for logging. Checks the features in the
+ * order of the HOT_KERNEL target_clones list, as the compiler's resolver does.
+ */
+const char *cpu_dispatch_target()
+{
+#if defined(CPU_DISPATCH)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return "AVX-512";
+	if (__builtin_cpu_supports("avx2"))
+		return "AVX2";
+	if (__builtin_cpu_supports("sse4.2"))
+		return "SSE4.2";
+	return "generic x86-64";
+#else
+	return "generic (built without CPU dispatch)";
+#endif
+}
+
+/*
+ * Critical value of the chi-square distribution with one degree of freedom,
+ * i.e. the x for which pchisq1(x) = p. Found by bisection on erfc so that
+ * comparing a statistic against it agrees with comparing pchisq1 against p.
+ * @param double p Upper tail probability
+ * @ret double Chi-square critical value
+ */
+double qchisq1(double p)
+{
+	double lo = 0.0, hi = 40.0; // erfc(40) is below the smallest double
+
+	if (p >= 1.0)
+		return 0.0;
+	if (p <= 0.0)
+		return std::numeric_limits<double>::infinity();
+
+	for (int i = 0; i < 200 && hi - lo > 0; i++) {
+		double mid = 0.5 * (lo + hi);
+		if (mid == lo || mid == hi)
+			break;
+		if (std::erfc(mid) > p)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return 2.0 * lo * lo;
+}
+
+/*
+ * 64-bit FNV-1a hash. Unlike std::hash its values do not depend on the standard
+ * library, so they can name files and segments shared between builds.
+ * @param data Bytes to hash
+ * @param len Number of bytes
+ * @param h Hash to continue from, to hash several pieces as one
+ * @ret uint64_t Hash value
+ */
+uint64_t fnv1a(const void *data, std::size_t len, uint64_t h)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	for (std::size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
 /*
  * Vector function that will find the median of the given vector.
  * @param vector<double> &x Vector whose median is required
@@ -133,13 +251,6 @@ void v_remove_dupes(std::vector<size_t> &v)
 	v.erase(std::unique(v.begin(), v.end()), v.end());
 }
 
-void eigenVector2Vector(Eigen::VectorXd &x, std::vector<double> &y)
-{
-	y.resize(x.size());
-	for (size_t i = 0; i != x.size(); i++)
-		y[i] = x[i];
-}
-
 /*
  * Caculates log of the sum of exponentiated logs excluding the max
  */
@@ -219,3 +330,36 @@ bool isNumber(std::string s)
 {
 	return std::all_of(s.begin(), s.end(), ::isdigit);
 }
+
+/*
+ * Parses a comma separated list of values, or a range "from:to:n" of n values spaced
+ * evenly on the log scale, e.g. "1e-6:1e-4:3" for 1e-6, 1e-5 and 1e-4.
+ * @ret bool False if the values could not be parsed
+ */
+bool parse_log_range(const std::string &spec, std::vector<double> &values)
+{
+	std::stringstream ss(spec);
+	std::string item;
+
+	values.clear();
+	try {
+		if (std::count(spec.begin(), spec.end(), ':') == 2) {
+			std::size_t c1 = spec.find(':'), c2 = spec.find(':', c1 + 1);
+			double from = std::stod(spec.substr(0, c1)), to = std::stod(spec.substr(c1 + 1, c2 - c1 - 1));
+			int n = std::stoi(spec.substr(c2 + 1));
+
+			if (from <= 0.0 || to <= 0.0 || n < 1)
+				return false;
+			for (int i = 0; i < n; i++)
+				values.push_back(n == 1 ? from : std::exp(std::log(from) + (std::log(to) - std::log(from)) * i / (n - 1)));
+			return true;
+		}
+
+		while (std::getline(ss, item, ','))
+			values.push_back(std::stod(item));
+	}
+	catch (...) {
+		return false;
+	}
+	return !values.empty();
+}
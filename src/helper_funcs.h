@@ -1,13 +1,17 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 #include <complex>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <fcntl.h>
 #include <fstream>
+#include <limits>
 #include <map>
 #include <numeric>
+#include <sstream>
 #include <vector>
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
@@ -18,12 +22,26 @@
 
 #define FLOATERR std::numeric_limits<double>::epsilon();
 
+// Hot kernels are compiled for several instruction sets and the loader picks the best
+// one the CPU supports, so one portable binary runs at native speed on every node.
+#ifdef CPU_DISPATCH
+#define HOT_KERNEL __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define HOT_KERNEL
+#endif
+
 bool file_exists(const std::string &name);
 void checkEntry(std::string txt, double *val);
 
 bool isFloatEqual(double lhs, double rhs);
 std::string string2upper(const std::string &str);
 double pchisq(double x, double df);
+double pchisq1(double x);
+void pchisq1(const double *x, double *p, std::size_t n);
+double dot_kernel(const double *a, const double *b, std::size_t n);
+const char *cpu_dispatch_target();
+double qchisq1(double p);
+uint64_t fnv1a(const void *data, std::size_t len, uint64_t h = 14695981039346656037ULL);
 
 double v_calc_median(const std::vector<double> &x);
 std::vector<std::size_t> v_sort_indices(const std::vector<std::string> &v);
@@ -32,15 +50,23 @@ std::vector<std::size_t> v_remove_nans(std::vector<size_t> &v);
 std::vector<std::string> v_merge_nodupes(std::vector<std::string> v1, std::vector<std::string> v2);
 void v_remove_dupes(std::vector<std::string> &v);
 void v_remove_dupes(std::vector<size_t> &v);
-void eigenVector2Vector(Eigen::VectorXd &x, std::vector<double> &y);
 double logsum(const std::vector<double> &x);
 double logdiff(double x, double y);
 
+template <typename T>
+void eigenVector2Vector(const Eigen::Matrix<T, Eigen::Dynamic, 1> &x, std::vector<double> &y)
+{
+	y.resize(x.size());
+	for (Eigen::Index i = 0; i < x.size(); i++)
+		y[i] = (double)x[i];
+}
+
 double lm(const std::vector<double> &x, const std::vector<double> &y);
 double lm_fixed(const std::vector<double> &x, const std::vector<double> &y);
 
 bool file_is_empty(std::ifstream &pFile);
 bool isNumber(std::string s);
+bool parse_log_range(const std::string &spec, std::vector<double> &values);
 
 //template<typename KeyType, typename LeftValue, typename RightValue>
 //std::map<KeyType, std::pair<LeftValue, RightValue> > IntersectMaps(const std::map<KeyType, LeftValue> &left, const std::map<KeyType, RightValue> &right);
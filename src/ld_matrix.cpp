@@ -0,0 +1,294 @@
+#include "ld_matrix.h"
+
+matrix_ld::matrix_ld()
+{
+	samples = 0;
+}
+
+/*
+ * Reads the LD matrix for prefix, preferring the binary format.
+ * @param string prefix Path to the matrix files without their ending
+ * @param size_t n Sample size of the matrix; only required for text matrices
+ * @ret int 0 if failed, 1 if successful
+ */
+int matrix_ld::read_matrix(const string &prefix, size_t n)
+{
+	if (file_exists(prefix + ".ldm")) {
+		// A text matrix written after the conversion replaces it
+		error_code ec;
+		fs::file_time_type converted = fs::last_write_time(prefix + ".ldm", ec);
+		bool stale = false;
+
+		for (const string &f : { prefix + ".ld", prefix + ".snps" }) {
+			if (file_exists(f) && fs::last_write_time(f, ec) > converted)
+				stale = true;
+		}
+		if (!stale)
+			return read_binary(prefix + ".ldm");
+		if (n == 0) {
+			spdlog::warn("{}.ld or {}.snps is newer than {}.ldm, but --ld_matrix_n is not given to convert it again; using the old {}.ldm.", prefix, prefix, prefix, prefix);
+			return read_binary(prefix + ".ldm");
+		}
+		spdlog::info("{}.ld or {}.snps is newer than {}.ldm; converting the text matrix again.", prefix, prefix, prefix);
+	}
+
+	if (n == 0) {
+		spdlog::critical("The sample size of a text LD matrix must be given using --ld_matrix_n.");
+		return 0;
+	}
+	samples = n;
+
+	if (read_text(prefix + ".ld", prefix + ".snps") == 0)
+		return 0;
+
+	write_binary(prefix + ".ldm");
+	return 1;
+}
+
+/*
+ * Reads a length-prefixed string, checking its length against the left bytes of the file.
+ */
+static bool read_string(ifstream &file, string &s, uintmax_t &left)
+{
+	uint32_t len = 0;
+	file.read(reinterpret_cast<char *>(&len), sizeof(len));
+	if (!file || left < sizeof(len) || len > left - sizeof(len))
+		return false;
+	left -= sizeof(len) + len;
+	s.resize(len);
+	file.read(&s[0], len);
+	return (bool)file;
+}
+
+static void write_string(ofstream &file, const string &s)
+{
+	uint32_t len = (uint32_t)s.size();
+	file.write(reinterpret_cast<const char *>(&len), sizeof(len));
+	file.write(s.data(), len);
+}
+
+/*
+ * Binary format: magic, number of SNPs, sample size, then for each SNP its name, chr,
+ * bp, A1, A2, A1 frequency, band width w and the w correlations with the SNPs after it.
+ * Every count is checked against the size of the file before anything is allocated.
+ */
+int matrix_ld::read_binary(const string &filename)
+{
+	const uintmax_t header = 24, min_record = 30; // Record with empty strings and no band
+	error_code ec;
+	uintmax_t left = fs::file_size(filename, ec);
+	ifstream file(filename, ios::binary);
+	char magic[8];
+	uint64_t n = 0, n_samples = 0;
+
+	spdlog::info("Reading LD matrix from {}.", filename);
+	file.read(magic, 8);
+	file.read(reinterpret_cast<char *>(&n), sizeof(n));
+	file.read(reinterpret_cast<char *>(&n_samples), sizeof(n_samples));
+	if (ec || !file || left < header || memcmp(magic, ldm_magic, 8) != 0) {
+		spdlog::critical("LD matrix file {} is not in the expected format.", filename);
+		return 0;
+	}
+	left -= header;
+	if (n > left / min_record) {
+		spdlog::critical("LD matrix file {} is truncated or corrupt.", filename);
+		return 0;
+	}
+	samples = n_samples;
+
+	snp_name.resize(n);
+	snp_chr.resize(n);
+	snp_bp.resize(n);
+	snp_allele1.resize(n);
+	snp_allele2.resize(n);
+	snp_freq.resize(n);
+	band.resize(n);
+	size_t i = 0;
+	for (i = 0; i < n; i++) {
+		uint32_t w = 0;
+
+		if (!read_string(file, snp_name[i], left) || left < sizeof(unsigned short) + sizeof(int))
+			break;
+		file.read(reinterpret_cast<char *>(&snp_chr[i]), sizeof(unsigned short));
+		file.read(reinterpret_cast<char *>(&snp_bp[i]), sizeof(int));
+		left -= sizeof(unsigned short) + sizeof(int);
+		if (!read_string(file, snp_allele1[i], left) || !read_string(file, snp_allele2[i], left) || left < sizeof(double) + sizeof(w))
+			break;
+		file.read(reinterpret_cast<char *>(&snp_freq[i]), sizeof(double));
+		file.read(reinterpret_cast<char *>(&w), sizeof(w));
+		left -= sizeof(double) + sizeof(w);
+		if (!file || w > left / sizeof(float))
+			break;
+		band[i].resize(w);
+		file.read(reinterpret_cast<char *>(band[i].data()), w * sizeof(float));
+		left -= w * sizeof(float);
+		snp_map.insert(pair<string, size_t>(snp_name[i], i));
+	}
+
+	if (!file || left != 0 || i != n) {
+		spdlog::critical("LD matrix file {} is truncated or corrupt.", filename);
+		return 0;
+	}
+
+	spdlog::info("Read LD for {} SNPs (estimated from {} samples).", n, samples);
+	return 1;
+}
+
+/*
+ * Reads a dense text matrix and its SNP list; only the band of each row up to its
+ * last non-zero entry past the diagonal is kept.
+ */
+int matrix_ld::read_text(const string &ld_file, const string &snp_file)
+{
+	string line, name, chr, a1, a2;
+	int bp;
+	double freq;
+	size_t i = 0;
+
+	ifstream snps(snp_file);
+	if (!snps) {
+		spdlog::critical("LD matrix SNP file cannot be opened for reading: {}.", snp_file);
+		return 0;
+	}
+
+	while (getline(snps, line)) {
+		istringstream ss(line);
+		if (!(ss >> name >> chr >> bp >> a1 >> a2 >> freq)) {
+			if (snp_name.empty()) // Header
+				continue;
+			spdlog::critical("Could not parse line {} of LD matrix SNP file {}.", snp_name.size() + 1, snp_file);
+			return 0;
+		}
+		transform(a1.begin(), a1.end(), a1.begin(), ::toupper);
+		transform(a2.begin(), a2.end(), a2.begin(), ::toupper);
+		snp_map.insert(pair<string, size_t>(name, snp_name.size()));
+		snp_name.push_back(name);
+		snp_chr.push_back(isNumber(chr) ? stoi(chr) : 0); // Left out of the reference like in read_bimfile
+		snp_bp.push_back(bp);
+		snp_allele1.push_back(a1);
+		snp_allele2.push_back(a2);
+		snp_freq.push_back(freq);
+	}
+	snps.close();
+
+	ifstream ld(ld_file);
+	if (!ld) {
+		spdlog::critical("LD matrix file cannot be opened for reading: {}.", ld_file);
+		return 0;
+	}
+	spdlog::info("Importing text LD matrix from {} for {} SNPs.", ld_file, snp_name.size());
+
+	band.resize(snp_name.size());
+	for (i = 0; i < snp_name.size(); i++) {
+		vector<float> row;
+		size_t j = 0, last = i;
+
+		if (!getline(ld, line)) {
+			spdlog::critical("LD matrix {} has fewer rows than the {} SNPs listed in {}.", ld_file, snp_name.size(), snp_file);
+			return 0;
+		}
+
+		const char *c = line.c_str();
+		char *end;
+		for (j = 0; j < snp_name.size(); j++) {
+			double r = strtod(c, &end);
+			if (end == c) {
+				spdlog::critical("Row {} of LD matrix {} has fewer than {} entries.", i + 1, ld_file, snp_name.size());
+				return 0;
+			}
+			c = end;
+
+			if (j <= i)
+				continue;
+			if (std::isnan(r))
+				r = 0.0;
+			row.push_back((float)r);
+			if (r != 0.0)
+				last = j;
+		}
+		row.resize(last - i);
+		band[i].swap(row);
+	}
+
+	return 1;
+}
+
+/*
+ * Written under a temporary name and then renamed, so an interrupted write never leaves
+ * a partial .ldm that would be read in place of the text matrix.
+ */
+void matrix_ld::write_binary(const string &filename)
+{
+	string tmp = filename + ".tmp" + to_string(getpid());
+	ofstream file(tmp, ios::binary);
+	uint64_t n = snp_name.size(), n_samples = samples;
+
+	file.write(ldm_magic, 8);
+	file.write(reinterpret_cast<const char *>(&n), sizeof(n));
+	file.write(reinterpret_cast<const char *>(&n_samples), sizeof(n_samples));
+	for (size_t i = 0; i < n; i++) {
+		uint32_t w = (uint32_t)band[i].size();
+
+		write_string(file, snp_name[i]);
+		file.write(reinterpret_cast<const char *>(&snp_chr[i]), sizeof(unsigned short));
+		file.write(reinterpret_cast<const char *>(&snp_bp[i]), sizeof(int));
+		write_string(file, snp_allele1[i]);
+		write_string(file, snp_allele2[i]);
+		file.write(reinterpret_cast<const char *>(&snp_freq[i]), sizeof(double));
+		file.write(reinterpret_cast<const char *>(&w), sizeof(w));
+		file.write(reinterpret_cast<const char *>(band[i].data()), w * sizeof(float));
+	}
+
+	file.close();
+
+	error_code ec;
+	if (file)
+		fs::rename(tmp, filename, ec);
+	if (!file || ec) {
+		fs::remove(tmp, ec);
+		spdlog::warn("Could not write the binary LD matrix {}; the text matrix will be imported again next time.", filename);
+	}
+	else {
+		spdlog::info("Saved the LD matrix in binary format to {}.", filename);
+	}
+}
+
+/*
+ * Hands the SNP information and frequencies to the reference in place of the .bim, .fam and .bed files.
+ */
+void matrix_ld::fill_reference(reference *ref)
+{
+	ref->set_snp_info(snp_name, snp_chr, snp_bp, snp_allele1, snp_allele2, snp_freq, samples);
+}
+
+double matrix_ld::rval(size_t i, size_t j)
+{
+	if (i > j)
+		swap(i, j);
+	return j - i <= band[i].size() ? band[i][j - i - 1] : 0.0;
+}
+
+/*
+ * Variance of the A1 allele count under Hardy-Weinberg equilibrium.
+ */
+double matrix_ld::variance(reference *ref, size_t r)
+{
+	double p = ref->mu[r] / 2.0;
+	return 2.0 * p * (1.0 - p);
+}
+
+void matrix_ld::covariance(reference *ref, size_t r, const vector<size_t> &targets, vector<double> &cov)
+{
+	auto iter = snp_map.find(ref->bim_snp_name[r]);
+	double sd_r = sqrt(variance(ref, r));
+
+	cov.resize(targets.size());
+	for (size_t k = 0; k < targets.size(); k++) {
+		auto iter_t = snp_map.find(ref->bim_snp_name[targets[k]]);
+		if (iter == snp_map.end() || iter_t == snp_map.end() || iter->second == iter_t->second) {
+			cov[k] = 0.0;
+			continue;
+		}
+		cov[k] = rval(iter->second, iter_t->second) * sd_r * sqrt(variance(ref, targets[k]));
+	}
+}
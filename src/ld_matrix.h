@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "data.h"
+#include "locus_ld.h"
+
+using namespace std;
+
+/*
+ * LD taken from a precomputed matrix of correlations instead of the genotypes, so its
+ * cost does not depend on the reference sample size. The matrix comes with the SNP
+ * information (chr, bp, alleles, A1 frequency) that would otherwise be read from the
+ * .bim/.bed files; correlations are for the A1 alleles.
+ *
+ * Two formats are read for a prefix:
+ *  <prefix>.ldm             binary banded format written by this class
+ *  <prefix>.ld + .snps      dense text matrix (one row per SNP, whitespace separated,
+ *                           e.g. plink --r square or numpy.savetxt) and a SNP list
+ *                           with columns SNP CHR BP A1 A2 FREQ
+ * A text matrix is converted to <prefix>.ldm on first use, and again whenever the text
+ * files are newer than the .ldm.
+ */
+class matrix_ld : public ld_source {
+public:
+	matrix_ld();
+
+	int read_matrix(const string &prefix, size_t n);
+	void fill_reference(reference *ref);
+
+	double variance(reference *ref, size_t r);
+	void covariance(reference *ref, size_t r, const vector<size_t> &targets, vector<double> &cov);
+
+private:
+	int read_binary(const string &filename);
+	int read_text(const string &ld_file, const string &snp_file);
+	void write_binary(const string &filename);
+	double rval(size_t i, size_t j);
+
+	vector<string> snp_name;
+	vector<unsigned short> snp_chr;
+	vector<int> snp_bp;
+	vector<string> snp_allele1;
+	vector<string> snp_allele2;
+	vector<double> snp_freq; /// Frequency of A1
+	vector<vector<float>> band; /// r between SNP i and SNPs i+1, i+2, ... up to its last non-zero entry
+	unordered_map<string, size_t> snp_map; /// SNP name to row
+	size_t samples; /// Sample size the matrix was estimated from
+
+	static constexpr const char *ldm_magic = "PWCOLDM1";
+};
@@ -0,0 +1,615 @@
+#include "locus_ld.h"
+
+/*
+ * Genotype of SNP r centred on the reference mean; missing genotypes are set to the mean.
+ */
+void genotype_ld::centred_genotype(reference *ref, size_t r, vector<double> &c)
+{
+	size_t i = 0,
+		n = ref->fam_ids_inc.size();
+
+	c.resize(n);
+	for (i = 0; i < n; i++) {
+		bool snp1 = ref->bed_snp_1[r][ref->fam_ids_inc[i]],
+			snp2 = ref->bed_snp_2[r][ref->fam_ids_inc[i]];
+		if (!snp1 || snp2)
+			c[i] = (snp1 ? 1.0 : 0.0) + (snp2 ? 1.0 : 0.0) - ref->mu[r];
+		else
+			c[i] = 0.0;
+	}
+}
+
+double genotype_ld::variance(reference *ref, size_t r)
+{
+	vector<double> c;
+
+	centred_genotype(ref, r, c);
+	return dot_kernel(c.data(), c.data(), c.size()) / (double)c.size();
+}
+
+void genotype_ld::covariance(reference *ref, size_t r, const vector<size_t> &targets, vector<double> &cov)
+{
+	vector<double> c_r;
+
+	centred_genotype(ref, r, c_r);
+	cov.resize(targets.size());
+
+#pragma omp parallel for
+	for (int k = 0; k < (int)targets.size(); k++) {
+		vector<double> c_t;
+		centred_genotype(ref, targets[k], c_t);
+		cov[k] = dot_kernel(c_r.data(), c_t.data(), c_t.size()) / (double)c_t.size();
+	}
+}
+
+sketch_ld::sketch_ld(size_t k, double collinear)
+{
+	this->k = k;
+	a_collinear = collinear;
+	enabled = false;
+	sketched = 0;
+	approx_pairs = 0;
+	exact_pairs = 0;
+}
+
+/*
+ * Maps the newly matched reference onto the sketches kept by name, dropping those of
+ * SNPs that are not in it. New individuals start the sketches afresh; the hashing is
+ * seeded so that results are reproducible.
+ */
+void sketch_ld::begin_pair(reference *ref)
+{
+	size_t i = 0,
+		n = ref->fam_ids_inc.size(),
+		m = ref->bim_snp_name.size();
+	unordered_map<string, shared_ptr<const sketch_row>> kept;
+	unique_lock<shared_mutex> guard(sketch_lock);
+
+	if (ref->fam_ids_inc != fam) {
+		fam = ref->fam_ids_inc;
+		sketch_map.clear();
+		bucket.clear();
+		sign.clear();
+		enabled = k < n;
+		if (!enabled) {
+			spdlog::warn("--ld_sketch {} is not smaller than the reference sample size ({}); LD is computed exactly.", k, n);
+		}
+		else {
+			mt19937_64 rng(20220101);
+
+			bucket.resize(n);
+			sign.resize(n);
+			for (i = 0; i < n; i++) {
+				bucket[i] = rng() % k;
+				sign[i] = (rng() & 1) ? 1.0 : -1.0;
+			}
+			spdlog::info("Approximating LD from a {}-dimensional sketch of {} individuals; the standard error of r is at most {:.3f}.", k, n, sqrt(2.0 / k));
+		}
+	}
+
+	sketches.assign(m, nullptr);
+	for (i = 0; i < m; i++) {
+		auto iter = sketch_map.find(ref->bim_snp_name[i]);
+		if (iter != sketch_map.end()) {
+			sketches[i] = iter->second;
+			kept.insert(*iter);
+		}
+	}
+	sketch_map.swap(kept);
+}
+
+/*
+ * Sketch of SNP r of the current reference, made on first use.
+ */
+const sketch_ld::sketch_row *sketch_ld::row(reference *ref, size_t r)
+{
+	{
+		shared_lock<shared_mutex> guard(sketch_lock);
+		if (sketches[r])
+			return sketches[r].get();
+	}
+
+	size_t n = fam.size();
+	vector<double> c;
+	shared_ptr<sketch_row> made = make_shared<sketch_row>();
+
+	centred_genotype(ref, r, c);
+	made->s.assign(k, 0.0);
+	for (size_t i = 0; i < n; i++)
+		made->s[bucket[i]] += sign[i] * c[i];
+	made->sd = sqrt(dot_kernel(c.data(), c.data(), n) / (double)n);
+
+	// Another thread may have sketched it meanwhile; both sketches are identical
+	unique_lock<shared_mutex> guard(sketch_lock);
+	if (!sketches[r]) {
+		sketches[r] = made;
+		sketch_map[ref->bim_snp_name[r]] = made;
+		sketched++;
+	}
+	return sketches[r].get();
+}
+
+void sketch_ld::covariance(reference *ref, size_t r, const vector<size_t> &targets, vector<double> &cov)
+{
+	size_t n = ref->fam_ids_inc.size();
+	vector<char> near(targets.size(), 0);
+	vector<size_t> exact;
+
+	if (!enabled) {
+		genotype_ld::covariance(ref, r, targets, cov);
+		return;
+	}
+
+	const sketch_row *s_r = row(ref, r);
+	cov.resize(targets.size());
+#pragma omp parallel for
+	for (int j = 0; j < (int)targets.size(); j++) {
+		const sketch_row *s_t = row(ref, targets[j]);
+		double s = s_r->sd * s_t->sd, rv, se;
+
+		cov[j] = dot_kernel(s_r->s.data(), s_t->s.data(), k) / (double)n;
+
+		// Pairs that could be near the collinearity threshold are worth the exact dot product
+		rv = s > 0.0 ? min(1.0, fabs(cov[j]) / s) : 0.0;
+		se = sqrt((1.0 + rv * rv) / k);
+		near[j] = rv + 3.0 * se >= sqrt(a_collinear);
+	}
+
+	for (size_t j = 0; j < targets.size(); j++) {
+		if (near[j])
+			exact.push_back(j);
+	}
+	approx_pairs += targets.size() - exact.size();
+	exact_pairs += exact.size();
+	if (exact.empty())
+		return;
+
+	vector<size_t> exact_targets(exact.size());
+	vector<double> exact_cov;
+	for (size_t j = 0; j < exact.size(); j++)
+		exact_targets[j] = targets[exact[j]];
+	genotype_ld::covariance(ref, r, exact_targets, exact_cov);
+	for (size_t j = 0; j < exact.size(); j++)
+		cov[exact[j]] = exact_cov[j];
+}
+
+void sketch_ld::log_stats()
+{
+	size_t a = approx_pairs.exchange(0), e = exact_pairs.exchange(0), s = sketched.exchange(0);
+	if (s > 0)
+		spdlog::info("{} SNPs were sketched for LD.", s);
+	if (a + e > 0)
+		spdlog::info("{} LD pairs were taken from the sketch and {} recomputed exactly near the collinearity threshold.", a, e);
+}
+
+locus_ld::locus_ld(ld_source *source)
+{
+	this->source = source;
+	ref = nullptr;
+	lookups = 0;
+	hits = 0;
+	cache_size = 0.0;
+	dirty = false;
+}
+
+/*
+ * Keep LD blocks in dir between runs. Blocks are only reused with the same reference
+ * files, which are fingerprinted by their size and modification time, and the same
+ * --chr and --maf.
+ */
+void locus_ld::set_disk_cache(const string &dir, const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr, double maf, double size_mb)
+{
+	error_code ec;
+	string id;
+
+	fs::create_directories(dir, ec);
+	if (!fs::is_directory(dir, ec)) {
+		spdlog::warn("Could not create LD cache directory {}; LD will not be cached between runs.", dir);
+		return;
+	}
+
+	for (const string &f : { bim_file, bed_file, fam_file }) {
+		uintmax_t size = fs::file_size(f, ec);
+		if (ec) {
+			spdlog::warn("Could not read {} to fingerprint the reference; LD will not be cached between runs.", f);
+			return;
+		}
+		id += to_string(size) + ":" + to_string(fs::last_write_time(f, ec).time_since_epoch().count()) + ";";
+	}
+
+	id += "chr=" + to_string(chr) + ";maf=" + to_string(maf) + ";";
+
+	stringstream ss;
+	ss << hex << fnv1a(id.data(), id.size());
+	fingerprint = ss.str();
+	cache_dir = dir;
+	cache_size = size_mb * 1024.0 * 1024.0;
+	spdlog::info("Caching LD blocks in {} (reference fingerprint {}).", cache_dir, fingerprint);
+}
+
+/*
+ * Map the slots to the reference as matched for the next pair. If at least min_overlap
+ * of its SNPs were in the previous pair it continues that locus group, keeping only the
+ * slots of its own SNPs; otherwise it starts a new group. Either way the previous
+ * pair's LD is written to the disk cache and anything cached for this pair's region
+ * is merged in from it.
+ */
+void locus_ld::begin_pair(reference *ref)
+{
+	size_t i = 0, shared = 0;
+	unique_lock<shared_mutex> guard(cache_lock);
+
+	this->ref = ref;
+	fill(slot_ref.begin(), slot_ref.end(), npos);
+	source->begin_pair(ref);
+
+	for (i = 0; i < ref->bim_snp_name.size(); i++) {
+		if (slot_map.count(ref->bim_snp_name[i]))
+			shared++;
+	}
+
+	save_block();
+	if (shared > 0 && shared >= min_overlap * ref->bim_snp_name.size()) {
+		spdlog::info("Reusing LD from the previous locus for {} of {} reference SNPs.", shared, ref->bim_snp_name.size());
+		keep_slots(ref);
+	}
+	else {
+		reset();
+	}
+
+	if (!cache_dir.empty() && !ref->bim_bp.empty()) {
+		block_file = block_name(ref);
+		if (!load_block())
+			dirty = !slot_name.empty(); // Carried over from the previous pair but not on disk under this name
+	}
+}
+
+/*
+ * Write the current locus group to the disk cache if anything new was computed.
+ */
+void locus_ld::flush()
+{
+	unique_lock<shared_mutex> guard(cache_lock);
+	save_block();
+}
+
+void locus_ld::clear()
+{
+	unique_lock<shared_mutex> guard(cache_lock);
+	reset();
+}
+
+/*
+ * Drop the slots, and the covariances involving them, of SNPs that are not in ref so
+ * that a chain of overlapping pairs does not grow the cache without bound.
+ */
+void locus_ld::keep_slots(reference *ref)
+{
+	size_t i = 0;
+	vector<size_t> new_slot(slot_name.size(), npos);
+	unordered_map<string, size_t> kept_map;
+	vector<string> kept_name;
+	vector<double> kept_var;
+	unordered_map<uint64_t, double> kept_cov;
+
+	for (i = 0; i < ref->bim_snp_name.size(); i++) {
+		auto iter = slot_map.find(ref->bim_snp_name[i]);
+		if (iter == slot_map.end() || new_slot[iter->second] != npos)
+			continue;
+		new_slot[iter->second] = kept_name.size();
+		kept_map.insert(pair<string, size_t>(iter->first, kept_name.size()));
+		kept_name.push_back(iter->first);
+		kept_var.push_back(var[iter->second]);
+	}
+	if (kept_name.size() == slot_name.size())
+		return;
+
+	kept_cov.reserve(cov_cache.size());
+	for (const auto &entry : cov_cache) {
+		size_t s = new_slot[entry.first >> 32], t = new_slot[entry.first & 0xffffffff];
+		if (s != npos && t != npos)
+			kept_cov[pair_key(s, t)] = entry.second;
+	}
+
+	slot_map.swap(kept_map);
+	slot_name.swap(kept_name);
+	var.swap(kept_var);
+	cov_cache.swap(kept_cov);
+	slot_ref.assign(slot_name.size(), npos);
+}
+
+void locus_ld::reset()
+{
+	slot_map.clear();
+	slot_name.clear();
+	slot_ref.clear();
+	var.clear();
+	cov_cache.clear();
+	block_file.clear();
+	dirty = false;
+}
+
+/*
+ * Cache file for the region covered by the matched reference and the individuals
+ * included from it.
+ */
+string locus_ld::block_name(reference *ref)
+{
+	auto chr = minmax_element(ref->bim_chr.begin(), ref->bim_chr.end());
+	auto bp = minmax_element(ref->bim_bp.begin(), ref->bim_bp.end());
+	stringstream ind;
+	ind << hex << fnv1a(ref->fam_ids_inc.data(), ref->fam_ids_inc.size() * sizeof(size_t));
+	return (fs::path(cache_dir) / (fingerprint + "_" + to_string(*chr.first) + "-" + to_string(*chr.second)
+		+ "_" + to_string(*bp.first) + "-" + to_string(*bp.second) + "_" + ind.str() + ".ld")).string();
+}
+
+/*
+ * Merge the cache file for the current pair into the slots; values already held are
+ * kept. The file is checked in full before anything is merged. Returns false if there
+ * is no usable file.
+ *
+ * Block format: magic, number of slots, then each slot's name and variance (NaN if
+ * not computed), then the number of cached pairs followed by (slot, slot, covariance).
+ * Values are kept as doubles so results do not depend on whether the cache was hit.
+ */
+bool locus_ld::load_block()
+{
+	const uint32_t max_name = 1024;
+	error_code ec;
+	uintmax_t size = fs::file_size(block_file, ec), pos = 0;
+	ifstream file(block_file, ios::binary);
+	char magic[8];
+	uint64_t n = 0, n_cov = 0, s = 0, k = 0;
+
+	if (ec || !file.is_open())
+		return false;
+
+	auto invalid = [&](const char *why) {
+		spdlog::warn("Ignoring LD cache file {} as {}.", block_file, why);
+		return false;
+	};
+
+	file.read(magic, 8);
+	file.read(reinterpret_cast<char *>(&n), sizeof(n));
+	if (!file || size < 16 || memcmp(magic, ld_magic, 8) != 0)
+		return invalid("it is not in the expected format");
+	pos = 16;
+	if (n > (size - pos) / (sizeof(uint32_t) + 1 + sizeof(double))) // Each slot takes at least this much
+		return invalid("its number of SNPs does not fit its size");
+
+	vector<string> names(n);
+	vector<double> vars(n);
+	unordered_map<string, size_t> seen;
+	for (s = 0; s < n; s++) {
+		uint32_t len = 0;
+
+		file.read(reinterpret_cast<char *>(&len), sizeof(len));
+		pos += sizeof(len);
+		if (!file || len == 0 || len > max_name || len + sizeof(double) > size - pos)
+			return invalid("a SNP name is malformed");
+		names[s].resize(len);
+		file.read(&names[s][0], len);
+		file.read(reinterpret_cast<char *>(&vars[s]), sizeof(double));
+		pos += len + sizeof(double);
+		if (!file || !seen.insert(pair<string, size_t>(names[s], s)).second)
+			return invalid("a SNP name is malformed or repeated");
+	}
+
+	file.read(reinterpret_cast<char *>(&n_cov), sizeof(n_cov));
+	pos += sizeof(n_cov);
+	if (!file || pos > size || (size - pos) / 16 != n_cov || (size - pos) % 16 != 0)
+		return invalid("its number of pairs does not match its size");
+
+	vector<uint32_t> cov_s(n_cov), cov_t(n_cov);
+	vector<double> cov_v(n_cov);
+	for (k = 0; k < n_cov; k++) {
+		file.read(reinterpret_cast<char *>(&cov_s[k]), sizeof(uint32_t));
+		file.read(reinterpret_cast<char *>(&cov_t[k]), sizeof(uint32_t));
+		file.read(reinterpret_cast<char *>(&cov_v[k]), sizeof(double));
+		if (!file || cov_s[k] >= n || cov_t[k] >= n)
+			return invalid("it is truncated or a pair is out of range");
+	}
+
+	// Valid: map the file's slots onto ours, registering SNPs not held yet
+	bool extra = false; // Values are held that the file does not have
+	vector<size_t> file_slot(n);
+	for (s = 0; s < n; s++) {
+		auto iter = slot_map.find(names[s]);
+		if (iter == slot_map.end()) {
+			file_slot[s] = slot_name.size();
+			slot_map.insert(pair<string, size_t>(names[s], slot_name.size()));
+			slot_name.push_back(names[s]);
+			slot_ref.push_back(npos);
+			var.push_back(vars[s]);
+		}
+		else {
+			file_slot[s] = iter->second;
+			if (std::isnan(var[iter->second]))
+				var[iter->second] = vars[s];
+			else
+				extra |= std::isnan(vars[s]);
+		}
+	}
+	cov_cache.reserve(cov_cache.size() + n_cov);
+	for (k = 0; k < n_cov; k++)
+		cov_cache.insert(make_pair(pair_key(file_slot[cov_s[k]], file_slot[cov_t[k]]), cov_v[k]));
+	dirty = dirty || extra || slot_name.size() > n || cov_cache.size() > n_cov;
+
+	// Mark as recently used for eviction
+	fs::last_write_time(block_file, fs::file_time_type::clock::now(), ec);
+	spdlog::info("Loaded LD for {} SNPs and {} pairs from the LD cache.", n, n_cov);
+	return true;
+}
+
+void locus_ld::save_block()
+{
+	if (!dirty || block_file.empty())
+		return;
+
+	string tmp = block_file + ".tmp" + to_string(getpid());
+	ofstream file(tmp, ios::binary);
+	uint64_t n = slot_name.size(), n_cov = cov_cache.size();
+
+	file.write(ld_magic, 8);
+	file.write(reinterpret_cast<const char *>(&n), sizeof(n));
+	for (size_t s = 0; s < slot_name.size(); s++) {
+		uint32_t len = (uint32_t)slot_name[s].size();
+		file.write(reinterpret_cast<const char *>(&len), sizeof(len));
+		file.write(slot_name[s].data(), len);
+		file.write(reinterpret_cast<const char *>(&var[s]), sizeof(double));
+	}
+
+	file.write(reinterpret_cast<const char *>(&n_cov), sizeof(n_cov));
+	for (const auto &entry : cov_cache) {
+		uint32_t s = (uint32_t)(entry.first >> 32), t = (uint32_t)(entry.first & 0xffffffff);
+		file.write(reinterpret_cast<const char *>(&s), sizeof(s));
+		file.write(reinterpret_cast<const char *>(&t), sizeof(t));
+		file.write(reinterpret_cast<const char *>(&entry.second), sizeof(double));
+	}
+	file.close();
+
+	// Written under a temporary name so other runs sharing the directory never read a partial block
+	error_code ec;
+	fs::rename(tmp, block_file, ec);
+	if (ec || !file) {
+		spdlog::warn("Could not write LD cache file {}.", block_file);
+		fs::remove(tmp, ec);
+		return;
+	}
+	dirty = false;
+	evict_blocks();
+}
+
+/*
+ * Remove the least recently used blocks until the cache fits in its size cap.
+ * Temporary files more than an hour old were left by runs that stopped while
+ * writing and are removed as well.
+ */
+void locus_ld::evict_blocks()
+{
+	error_code ec;
+	uintmax_t total = 0;
+	vector<pair<fs::file_time_type, fs::path>> blocks;
+	fs::file_time_type stale = fs::file_time_type::clock::now() - chrono::hours(1);
+
+	for (const auto &entry : fs::directory_iterator(cache_dir, ec)) {
+		bool tmp = entry.path().filename().string().find(".ld.tmp") != string::npos;
+		if (!tmp && entry.path().extension() != ".ld")
+			continue;
+		if (tmp && entry.last_write_time(ec) < stale && fs::remove(entry.path(), ec))
+			continue;
+		total += entry.file_size(ec);
+		if (!tmp)
+			blocks.push_back(make_pair(entry.last_write_time(ec), entry.path()));
+	}
+
+	sort(blocks.begin(), blocks.end());
+	for (size_t i = 0; i < blocks.size() && total > cache_size; i++) {
+		if (blocks[i].second == fs::path(block_file))
+			continue;
+		total -= fs::file_size(blocks[i].second, ec);
+		fs::remove(blocks[i].second, ec);
+	}
+}
+
+/*
+ * Slot for the SNP at ref_idx in the current reference, registering it if needed.
+ * Analyses register their SNPs up front, before any lookups run across threads.
+ */
+size_t locus_ld::slot(size_t ref_idx)
+{
+	unique_lock<shared_mutex> guard(cache_lock);
+	const string &name = ref->bim_snp_name[ref_idx];
+	auto iter = slot_map.find(name);
+	size_t s;
+
+	if (iter == slot_map.end()) {
+		s = slot_name.size();
+		slot_map.insert(pair<string, size_t>(name, s));
+		slot_name.push_back(name);
+		slot_ref.push_back(ref_idx);
+		var.push_back(numeric_limits<double>::quiet_NaN());
+	}
+	else {
+		s = iter->second;
+		slot_ref[s] = ref_idx;
+	}
+	return s;
+}
+
+double locus_ld::variance(size_t s)
+{
+	lookups++;
+	{
+		shared_lock<shared_mutex> guard(cache_lock);
+		if (!std::isnan(var[s])) {
+			hits++;
+			return var[s];
+		}
+	}
+
+	double d = source->variance(ref, slot_ref[s]);
+
+	unique_lock<shared_mutex> guard(cache_lock);
+	var[s] = d;
+	dirty = true;
+	return d;
+}
+
+double locus_ld::covariance(size_t s, size_t t)
+{
+	vector<double> cov;
+	covariance(s, vector<size_t>(1, t), cov);
+	return cov[0];
+}
+
+/*
+ * Covariance between slot s and each slot in targets. Pairs not cached yet are computed
+ * outside of the lock, so concurrent analyses only serialise on the lookups.
+ */
+void locus_ld::covariance(size_t s, const vector<size_t> &targets, vector<double> &cov)
+{
+	size_t i = 0;
+	vector<size_t> missing;
+
+	cov.resize(targets.size());
+	lookups += targets.size();
+	{
+		shared_lock<shared_mutex> guard(cache_lock);
+		for (i = 0; i < targets.size(); i++) {
+			auto iter = cov_cache.find(pair_key(s, targets[i]));
+			if (iter == cov_cache.end())
+				missing.push_back(i);
+			else
+				cov[i] = iter->second;
+		}
+	}
+
+	hits += targets.size() - missing.size();
+	if (missing.empty())
+		return;
+
+	vector<size_t> missing_ref(missing.size());
+	vector<double> missing_cov;
+	for (i = 0; i < missing.size(); i++)
+		missing_ref[i] = slot_ref[targets[missing[i]]];
+	source->covariance(ref, slot_ref[s], missing_ref, missing_cov);
+	for (i = 0; i < missing.size(); i++)
+		cov[missing[i]] = missing_cov[i];
+
+	unique_lock<shared_mutex> guard(cache_lock);
+	for (i = 0; i < missing.size(); i++)
+		cov_cache[pair_key(s, targets[missing[i]])] = cov[missing[i]];
+	dirty = true;
+}
+
+/*
+ * Log how many of the values requested since the last call were served from the cache.
+ */
+void locus_ld::log_stats()
+{
+	size_t n = lookups.exchange(0), h = hits.exchange(0);
+	if (n > 0)
+		spdlog::info("LD cache served {} of {} genotype variance and covariance lookups ({:.1f}%).", h, n, 100.0 * h / n);
+	source->log_stats();
+}
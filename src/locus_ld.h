@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+#include <vector>
+
+#include "data.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+/*
+ * Where LD between reference SNPs comes from. Values are in bim orientation, i.e. for
+ * the A1 allele of the matched reference, and SNPs are given by their reference index.
+ */
+class ld_source {
+public:
+	virtual ~ld_source() {};
+
+	virtual void begin_pair(reference *ref) {};
+	virtual double variance(reference *ref, size_t r) = 0;
+	virtual void covariance(reference *ref, size_t r, const vector<size_t> &targets, vector<double> &cov) = 0;
+	virtual void log_stats() {};
+};
+
+/*
+ * LD computed from the individual-level genotypes read from the .bed file.
+ */
+class genotype_ld : public ld_source {
+public:
+	double variance(reference *ref, size_t r);
+	void covariance(reference *ref, size_t r, const vector<size_t> &targets, vector<double> &cov);
+
+protected:
+	void centred_genotype(reference *ref, size_t r, vector<double> &c);
+};
+
+/*
+ * Approximate LD from a count sketch of the centred genotypes: each individual is hashed
+ * to one of k buckets with a random sign, so every SNP is summarised in one O(n) pass
+ * and each covariance then costs O(k). The estimate is unbiased with a standard error
+ * in r of at most sqrt((1 + r^2) / k). Variances, and pairs whose r^2 could be within
+ * three standard errors of the collinearity threshold, are computed exactly.
+ *
+ * A SNP is only sketched the first time its LD is asked for. Sketches are kept by SNP
+ * name, as locus_ld keeps its slots, so a pair overlapping the previous one reuses
+ * them; only the current pair's SNPs are kept, and all are dropped if the individuals
+ * included change.
+ */
+class sketch_ld : public genotype_ld {
+public:
+	sketch_ld(size_t k, double collinear);
+
+	void begin_pair(reference *ref);
+	void covariance(reference *ref, size_t r, const vector<size_t> &targets, vector<double> &cov);
+	void log_stats();
+
+private:
+	struct sketch_row {
+		vector<double> s; /// Signed bucket sums of the centred genotype
+		double sd; /// Standard deviation of the genotype
+	};
+
+	const sketch_row *row(reference *ref, size_t r);
+
+	size_t k; /// Sketch dimension
+	double a_collinear; /// Collinearity threshold of the analyses
+	bool enabled; /// False if the reference has no more individuals than k
+	vector<size_t> fam; /// Individuals the sketches were built over
+	vector<size_t> bucket; /// Bucket of each individual
+	vector<double> sign; /// Sign of each individual
+	unordered_map<string, shared_ptr<const sketch_row>> sketch_map; /// Sketch of each SNP of the current pair sketched so far, by name
+	vector<shared_ptr<const sketch_row>> sketches; /// Sketch of each SNP in the current reference, null until first used
+	shared_mutex sketch_lock;
+	atomic<size_t> sketched; /// SNPs sketched since the last log_stats
+	atomic<size_t> approx_pairs; /// Covariances taken from the sketch
+	atomic<size_t> exact_pairs; /// Covariances recomputed exactly as they are near the threshold
+};
+
+/*
+ * LD for the SNPs at a locus, shared by every cond_analysis run against it.
+ * msx_b, B and Z only depend on the reference SNPs, so each variance and pairwise
+ * covariance is taken from the LD source once and then served to every trait.
+ *
+ * Values are held in bim orientation and each analysis applies its own allele
+ * orientation as a sign flip. SNPs are given a slot by name so that the cache
+ * survives the reference being rematched between pairs; consecutive pairs that
+ * mostly share SNPs therefore form one locus group. Only the current pair's SNPs are
+ * kept, so the cache is bounded by the size of one pair.
+ *
+ * With --ld_cache the LD of each pair is also kept on disk, keyed by a fingerprint of
+ * the reference files, --chr and --maf, the region it covers and the individuals
+ * included, so reruns skip the LD computations. The .bed file is still read and
+ * decoded for every pair: the allele frequencies come from it, and any LD not cached
+ * yet is computed from it.
+ *
+ * Lookups from the exposure and outcome analyses (and the .cojo output) run under a
+ * shared lock; only inserting newly computed values takes the lock exclusively.
+ */
+class locus_ld {
+public:
+	locus_ld(ld_source *source);
+
+	void set_disk_cache(const string &dir, const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr, double maf, double size_mb);
+	void begin_pair(reference *ref);
+	void flush();
+	void clear();
+
+	size_t slot(size_t ref_idx);
+	double variance(size_t s);
+	double covariance(size_t s, size_t t);
+	void covariance(size_t s, const vector<size_t> &targets, vector<double> &cov);
+
+	size_t num_slots() {
+		return slot_name.size();
+	}
+
+	void log_stats();
+
+private:
+	void reset();
+	void keep_slots(reference *ref);
+
+	string block_name(reference *ref);
+	bool load_block();
+	void save_block();
+	void evict_blocks();
+
+	static uint64_t pair_key(size_t s, size_t t) {
+		return s < t ? ((uint64_t)s << 32) | t : ((uint64_t)t << 32) | s;
+	}
+
+	ld_source *source; /// Genotypes or a precomputed LD matrix
+	reference *ref; /// Reference the slots are currently mapped to
+	unordered_map<string, size_t> slot_map; /// SNP name to slot
+	vector<string> slot_name; /// SNP name of each slot
+	vector<size_t> slot_ref; /// Position of each slot in the current reference, or npos if not in this pair
+	vector<double> var; /// Variance of each slot, NaN until computed
+	unordered_map<uint64_t, double> cov_cache; /// Covariance for each computed pair of slots
+	shared_mutex cache_lock;
+
+	string cache_dir; /// Directory for the on-disk LD cache; empty if disabled
+	string fingerprint; /// Identifies the reference files the cached LD was computed from
+	string block_file; /// Cache file for the current pair
+	double cache_size; /// Size cap of the cache directory in bytes
+	bool dirty; /// Values were computed since the block was loaded or saved
+
+	atomic<size_t> lookups; /// Variances and covariances requested since the last log_stats
+	atomic<size_t> hits; /// Of which were already cached
+
+	static constexpr size_t npos = numeric_limits<size_t>::max();
+	static constexpr double min_overlap = 0.5; /// Fraction of a pair's SNPs that must be cached to continue the group
+	static constexpr const char *ld_magic = "PWCOLD01";
+};
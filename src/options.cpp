@@ -10,6 +10,19 @@
 
 int main(int argc, char* argv[])
 {
+	// Client of a --serve process; the rest of the command line is the job
+	for (int k = 1; k + 1 < argc; k++) {
+		if (string(argv[k]) == "--submit") {
+			vector<string> args;
+
+			for (int a = 1; a < argc; a++) {
+				if (a != k && a != k + 1)
+					args.push_back(argv[a]);
+			}
+			return submit_job(argv[k + 1], args);
+		}
+	}
+
 	spdlog::info(" ****************************************");
 	spdlog::info(" *______ _    _ _____       _____       *");
 	spdlog::info(" *| ___ \\ |  | /  __ \\     /  __ \\      *");
@@ -27,20 +40,26 @@ int main(int argc, char* argv[])
 	 * Option reading
 	 */
 	unsigned short chr = 0;
-	int i = 0, threads = 8;
+	int i = 0, threads = 8, serve_jobs = 0,
+		scan_window = 0, scan_step = 0; // --coloc_scan window and step in bp
 	double p_cutoff1 = 5e-8, p_cutoff2 = 5e-8,
-		collinear = 0.9, maf = 0.1, ld_window = 1.0e7,
+		collinear = 0.9, collapse_r2 = 0.0, maf = 0.1, ld_window = 1.0e7,
 		freq_threshold = 0.2, init_h4 = 80, top_snp = 1e10,
 		p1 = 1e-4, p2 = 1e-4, p3 = 1e-5,
 		n1 = 0.0, n2 = 0.0, n1_case = 0.0, n2_case = 0.0,
-		pve1 = -1.0, pve2 = -1.0;
+		pve1 = -1.0, pve2 = -1.0,
+		ld_cache_size = 1024, ld_matrix_n = 0, ld_sketch = 0;
 	string bfile = "", bim_file = "", fam_file = "", bed_file = "",
 		phen1_file = "", phen2_file = "",
 		out = "pwcoco_out", log = "pwcoco_log", snplist = "",
 		pve_file1 = "", pve_file2 = "",
+		ld_cache = "", ld_matrix = "", serve_socket = "", ref_shm_name = "",
 		opt;
+	vector<coloc_prior> pp_grid; // Extra priors for --coloc_pp_grid
 	bool out_cond = false, cond_ssize = false,
-		verbose = false,
+		verbose = false, precision_check = false,
+		ref_shm_keep = false, // Leave the --ref_shm segment behind for later runs
+		coloc_only = false, // Only run the unconditioned colocalisation of every exposure against every outcome
 		data_folder = false, // Whether the data is in folders or files
 		pairwise = false; // Whether to run PWCoCo on the pairwise combination of folders or not (if folders are given)
 
@@ -85,6 +104,9 @@ int main(int argc, char* argv[])
 			spdlog::info("");
 			spdlog::info("	--collinear                Threshold that determines if SNPs are collinear; default is 0.9.");
 			spdlog::info("");
+			spdlog::info("	--collapse_r2              Leave SNPs in LD above this r2 with a stronger nearby SNP out of the stepwise selection;");
+			spdlog::info("	                           they are still conditioned for colocalisation. e.g. 0.99; default is 0 (off).");
+			spdlog::info("");
 			spdlog::info("	--maf                      Filters SNPs from the reference dataset according to this threshold; default is 0.1.");
 			spdlog::info("");
 			spdlog::info("	--freq_threshold           Exclude SNPs with an allele frequency difference between the sum stats and the reference data");
@@ -96,6 +118,10 @@ int main(int argc, char* argv[])
 			spdlog::info("");
 			spdlog::info("	--coloc_pp                 Specify the three prior probabilities; default 1e-4, 1e-4 and 1e-5.");
 			spdlog::info("");
+			spdlog::info("	--coloc_pp_grid            Also report the posteriors for every combination of these p1, p2 and p12 values in");
+			spdlog::info("	                           <out>.coloc_grid. Each of the three arguments is a comma separated list or a range");
+			spdlog::info("	                           from:to:n of n log-spaced values, e.g. 1e-4 1e-4 1e-6:1e-4:5.");
+			spdlog::info("");
 			spdlog::info("	--n1, n2                   Specify the sample size for summary statistics.");
 			spdlog::info("");
 			spdlog::info("	--n1_case, n2_case         Specific the number of cases for summary statistics.");
@@ -106,6 +132,45 @@ int main(int argc, char* argv[])
 			spdlog::info("");
 			spdlog::info("	--pairwise                 If using folders as input, will run PWCoCo on the pairwise combination of files.");
 			spdlog::info("	                           Without this flag, the files must match based on name.");
+			spdlog::info("");
+			spdlog::info("	--serve                    Read the reference once and run the jobs sent to this Unix socket with --submit until");
+			spdlog::info("	                           one is sent --stop. Options given here are the defaults of every job.");
+			spdlog::info("");
+			spdlog::info("	--serve_jobs               Number of jobs a --serve process runs at the same time; --threads are split");
+			spdlog::info("	                           between them. Default is --threads.");
+			spdlog::info("");
+			spdlog::info("	--submit                   Send this command line as a job to the --serve process on this socket and wait for it");
+			spdlog::info("	                           to finish. Reference and LD options are those of the server.");
+			spdlog::info("");
+			spdlog::info("	--ref_shm                  Name of a shared-memory segment to hold the decoded reference, so that pwcoco runs on");
+			spdlog::info("	                           the same node read it once between them. The segment is removed when the last run");
+			spdlog::info("	                           using it finishes.");
+			spdlog::info("");
+			spdlog::info("	--ref_shm_keep             Leave the --ref_shm segment in place for later runs.");
+			spdlog::info("");
+			spdlog::info("	--coloc_scan               Colocalise --sum_stats1 and --sum_stats2 in sliding windows along the genome instead of");
+			spdlog::info("	                           running PWCoCo: the next two arguments are the window width and the step in kb, e.g.");
+			spdlog::info("	                           1000 250. SNP positions come from the .bim file; results are written to <out>.coloc_scan.");
+			spdlog::info("");
+			spdlog::info("	--coloc_only               Only colocalise every file of --sum_stats1 against every file of --sum_stats2, without");
+			spdlog::info("	                           conditioning. No reference is needed; results are written to <out>.coloc.");
+			spdlog::info("");
+			spdlog::info("	--ld_cache                 Directory in which to keep the reference LD computed for each locus, so that reruns");
+			spdlog::info("	                           against the same reference files can reuse it.");
+			spdlog::info("");
+			spdlog::info("	--ld_cache_size            Maximum size in MB of the --ld_cache directory; least recently used loci are removed");
+			spdlog::info("	                           first. Default is 1024.");
+			spdlog::info("");
+			spdlog::info("	--ld_matrix                Prefix of a precomputed LD matrix to use in place of --bfile: either <prefix>.ldm or a");
+			spdlog::info("	                           text matrix <prefix>.ld with its SNP list <prefix>.snps (SNP CHR BP A1 A2 FREQ).");
+			spdlog::info("");
+			spdlog::info("	--ld_matrix_n              Sample size the text LD matrix was estimated from.");
+			spdlog::info("");
+			spdlog::info("	--ld_sketch                Approximate LD from a sketch of the genotypes of this dimension (e.g. 512), which is");
+			spdlog::info("	                           much faster for large reference panels. Pairs near the --collinear threshold are exact.");
+			spdlog::info("");
+			spdlog::info("	--precision_check          In a build with PWCOCO_MIXED_PRECISION, repeat the conditional analyses with the LD");
+			spdlog::info("	                           rows of the selected SNPs in double and report how far the results are from them.");
 		}
 
 		if (opt == "--bfile") {
@@ -235,6 +300,15 @@ int main(int argc, char* argv[])
 
 			spdlog::info("--collinear {}.", collinear);
 		}
+		else if (opt == "--collapse_r2") {
+			collapse_r2 = stod(argv[++i]);
+
+			if (collapse_r2 < 0.0 || collapse_r2 > 1.0) {
+				collapse_r2 = (collapse_r2 < 0.0 ? 0.0 : 1.0);
+			}
+
+			spdlog::info("--collapse_r2 {}.", collapse_r2);
+		}
 		else if (opt == "--maf") {
 			maf = stod(argv[++i]);
 
@@ -278,6 +352,26 @@ int main(int argc, char* argv[])
 
 			spdlog::info("--coloc_pp p1 {} p2 {} p3 {}.", p1, p2, p3);
 		}
+		else if (opt == "--coloc_pp_grid") {
+			vector<double> grid_p[3];
+
+			for (int k = 0; k < 3; k++) {
+				string spec = argv[++i];
+				if (!parse_log_range(spec, grid_p[k])) {
+					spdlog::warn("Could not read the --coloc_pp_grid values {}; no grid will be computed.", spec);
+				}
+				for (auto &p : grid_p[k])
+					p = (p > 1.0 ? 1.0 : p < 1e-50 ? 1e-50 : p);
+			}
+
+			pp_grid.clear();
+			for (double a : grid_p[0])
+				for (double b : grid_p[1])
+					for (double c : grid_p[2])
+						pp_grid.push_back({ a, b, c });
+
+			spdlog::info("--coloc_pp_grid with {} combinations of priors.", pp_grid.size());
+		}
 		else if (opt == "--cond_ssize") {
 			cond_ssize = true;
 
@@ -309,6 +403,87 @@ int main(int argc, char* argv[])
 
 			spdlog::info("--pairwise.");
 		}
+		else if (opt == "--serve") {
+			serve_socket = argv[++i];
+
+			spdlog::info("--serve {}.", serve_socket);
+		}
+		else if (opt == "--serve_jobs") {
+			serve_jobs = stoi(argv[++i]);
+
+			spdlog::info("--serve_jobs {}.", serve_jobs);
+		}
+		else if (opt == "--ref_shm") {
+			ref_shm_name = argv[++i];
+
+			spdlog::info("--ref_shm {}.", ref_shm_name);
+		}
+		else if (opt == "--ref_shm_keep") {
+			ref_shm_keep = true;
+
+			spdlog::info("--ref_shm_keep.");
+		}
+		else if (opt == "--coloc_scan") {
+			scan_window = stoi(argv[++i]);
+			scan_step = stoi(argv[++i]);
+
+			if (scan_window <= 0 || scan_step <= 0) {
+				spdlog::warn("--coloc_scan window and step must be positive; the scan will not be run.");
+				scan_window = scan_step = 0;
+			}
+			else {
+				scan_window = (scan_window > 1000000 ? 1000000 : scan_window) * 1000;
+				scan_step = (scan_step > 1000000 ? 1000000 : scan_step) * 1000;
+				spdlog::info("--coloc_scan window {} step {}.", scan_window, scan_step);
+			}
+		}
+		else if (opt == "--coloc_only") {
+			coloc_only = true;
+
+			spdlog::info("--coloc_only.");
+		}
+		else if (opt == "--ld_cache") {
+			ld_cache = argv[++i];
+
+			spdlog::info("--ld_cache {}.", ld_cache);
+		}
+		else if (opt == "--ld_cache_size") {
+			ld_cache_size = stod(argv[++i]);
+
+			if (ld_cache_size < 1.0) {
+				ld_cache_size = 1.0;
+			}
+
+			spdlog::info("--ld_cache_size {}.", ld_cache_size);
+		}
+		else if (opt == "--ld_matrix") {
+			ld_matrix = argv[++i];
+
+			spdlog::info("--ld_matrix {}.", ld_matrix);
+		}
+		else if (opt == "--ld_matrix_n") {
+			ld_matrix_n = stod(argv[++i]);
+
+			if (ld_matrix_n < 0) {
+				ld_matrix_n = 0;
+			}
+
+			spdlog::info("--ld_matrix_n {}.", ld_matrix_n);
+		}
+		else if (opt == "--ld_sketch") {
+			ld_sketch = stod(argv[++i]);
+
+			if (ld_sketch < 0) {
+				ld_sketch = 0;
+			}
+
+			spdlog::info("--ld_sketch {}.", ld_sketch);
+		}
+		else if (opt == "--precision_check") {
+			precision_check = true;
+
+			spdlog::info("--precision_check.");
+		}
 	}
 
 	// First set up the logger
@@ -335,7 +510,7 @@ int main(int argc, char* argv[])
 	chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 
 	// .bim file MUST be supplied
-	if (bim_file.compare("") == 0) {
+	if (bim_file.compare("") == 0 && ld_matrix.empty() && !coloc_only) {
 		spdlog::critical("No .bim file found; a .bim file MUST be supplied!");
 		return 0;
 	}
@@ -345,7 +520,7 @@ int main(int argc, char* argv[])
 	//}
 
 	// .fam file MUST be supplied
-	if (fam_file.compare("") == 0) {
+	if (fam_file.compare("") == 0 && ld_matrix.empty() && !coloc_only) {
 		spdlog::critical("No .fam file found; a .fam file MUST be supplied!");
 		return 0;
 	}
@@ -375,6 +550,9 @@ int main(int argc, char* argv[])
 	if (data_folder && fs::is_directory(path2, ec2)) {
 		spdlog::info("Summary stats 2 is treated as a folder.");
 	}
+	else if (!serve_socket.empty()) {
+		// Summary statistics come with each job
+	}
 	else if (data_folder && !fs::is_directory(path2, ec2)) {
 		spdlog::info("Summary stats 2 expected to be a folder but is not. Please fix this before continuing.");
 		return 0;
@@ -387,14 +565,125 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 
+	spdlog::info("Using the {} variants of the .bed decoding, LD and Bayes factor kernels.", cpu_dispatch_target());
+
 #if defined(_OPENMP)
 	omp_set_dynamic(0);
 	omp_set_num_threads(threads);
 	spdlog::info("OpenMP will attempt to use up to {} threads.", threads);
 #endif
 
+	// Colocalisation screen; no reference or conditioning
+	if (coloc_only) {
+		coloc_screen screen(out, p1, p2, p3, pp_grid);
+
+		if (screen.add_datasets(phen1_file, true, n1, n1_case, pve1, pve_file1) == 0 || screen.add_datasets(phen2_file, false, n2, n2_case, pve2, pve_file2) == 0) {
+			spdlog::critical("No summary statistics could be read for the colocalisation screen.");
+			return 0;
+		}
+		screen.run();
+
+		chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		spdlog::info("Analysis finished. Computational time: {} secs", (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0);
+		return 0;
+	}
+
 	// Set up for some common variables
 	reference *ref = new reference(out, chr); // Reference dataset
+	matrix_ld *ld_mat = nullptr; // Precomputed LD used in place of the genotypes
+	if (!ld_matrix.empty()) {
+		ld_mat = new matrix_ld();
+		if (ld_mat->read_matrix(ld_matrix, (size_t)ld_matrix_n) == 0) {
+			return 0;
+		}
+	}
+
+	// Sliding-window colocalisation scan; only the SNP positions of the reference are needed
+	if (scan_window > 0) {
+		if (data_folder) {
+			spdlog::critical("--coloc_scan takes one file for each of --sum_stats1 and --sum_stats2, not folders.");
+			return 0;
+		}
+
+		phenotype *exposure = init_pheno(phen1_file, fs::path(phen1_file).filename().string(), n1, n1_case, pve1, pve_file1);
+		phenotype *outcome = init_pheno(phen2_file, fs::path(phen2_file).filename().string(), n2, n2_case, pve2, pve_file2);
+		if (exposure->has_failed() || outcome->has_failed()) {
+			spdlog::critical("Reading of summary statistic files has failed. Cannot continue with the colocalisation scan.");
+			return 0;
+		}
+
+		if (ld_mat)
+			ld_mat->fill_reference(ref);
+		else if (ref->read_bimfile(bim_file) == 0)
+			return 0;
+
+		coloc_scan scan(out, p1, p2, p3, scan_window, scan_step);
+		scan.run(exposure, outcome, ref);
+
+		chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		spdlog::info("Analysis finished. Computational time: {} secs", (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0);
+		return 0;
+	}
+
+	// Resident reference for jobs sent with --submit
+	if (!serve_socket.empty()) {
+		if (!ld_cache.empty())
+			spdlog::warn("--ld_cache is not used by --serve; the reference is already held in memory.");
+
+		// As for folders, the whole reference is read and every job takes the SNPs it needs
+		if (ld_mat) {
+			ld_mat->fill_reference(ref);
+			ref->whole_bim();
+			ref->sanitise_list();
+		}
+		else {
+			if (ref->read_bimfile(bim_file) == 0) {
+				return 0;
+			}
+			ref->whole_bim();
+			ref->sanitise_list();
+
+			if (ref->read_famfile(fam_file) == 0) {
+				return 0;
+			}
+			if (ref->read_bedfile(bed_file) == 0) {
+				return 0;
+			}
+		}
+
+		serve_job defaults = { "", "", pve_file1, pve_file2, out, n1, n2, n1_case, n2_case, pve1, pve2,
+			p_cutoff1, p_cutoff2, collinear, collapse_r2, ld_window, freq_threshold, init_h4, top_snp, p1, p2, p3,
+			out_cond, cond_ssize, verbose, pp_grid };
+		pwcoco_server server(serve_socket, ref, ld_mat, defaults, serve_jobs > 0 ? serve_jobs : threads, threads, ld_sketch, maf, chr);
+		return server.serve();
+	}
+
+	unique_ptr<shared_reference> ref_shm; // Reference shared with other processes, attached when first needed; detaches on every return
+	bool use_shm = !ref_shm_name.empty();
+	if (use_shm && ld_mat) {
+		spdlog::warn("--ref_shm is not used with --ld_matrix and will be ignored.");
+		use_shm = false;
+	}
+
+	ld_source *source;
+	if (ld_mat)
+		source = ld_mat;
+	else if (ld_sketch > 0)
+		source = new sketch_ld((size_t)ld_sketch, collinear);
+	else
+		source = new genotype_ld();
+
+	locus_ld *ld = new locus_ld(source); // LD shared by the analyses at a locus
+	if (!ld_cache.empty() && !ld_mat && ld_sketch == 0) { // Only exact genotype LD is kept between runs
+		ld->set_disk_cache(ld_cache, bim_file, bed_file, fam_file, chr, maf, ld_cache_size);
+	}
+
+#ifndef MIXED_PRECISION
+	if (precision_check) {
+		spdlog::warn("--precision_check only applies to builds with PWCOCO_MIXED_PRECISION and will be ignored.");
+		precision_check = false;
+	}
+#endif
 	init_h4 /= 100; // coloc returns h4 as a decimal
 
 	// Depending on whether the summary statistics are given as a folder
@@ -431,11 +720,29 @@ int main(int argc, char* argv[])
 					continue;
 				}
 
-				if (initial_coloc(exposure, outcome, out, p1, p2, p3, init_h4)) {
+				if (initial_coloc(exposure, outcome, out, p1, p2, p3, pp_grid, init_h4)) {
 					continue;
 				}
 
-				if (!ref->is_ready()) {
+				if (use_shm && !ref_shm) {
+					ref_shm.reset(new shared_reference(ref_shm_name, ref_shm_keep));
+					if (!ref_shm->attach(bim_file, bed_file, fam_file, chr, out)) {
+						ref_shm.reset();
+						use_shm = false;
+					}
+				}
+
+				if (ref_shm) {
+					// Only this pair's SNPs are copied out of the shared reference
+					ref_shm->match(ref, exposure->get_snp_names(), outcome->get_snp_names());
+				}
+				else if (!ref->is_ready() && ld_mat) {
+					// The LD matrix carries the SNP information and frequencies
+					ld_mat->fill_reference(ref);
+					ref->whole_bim();
+					ref->sanitise_list();
+				}
+				else if (!ref->is_ready()) {
 					// Bim-related first
 					if (ref->read_bimfile(bim_file) == 0) {
 						return 0;
@@ -460,7 +767,8 @@ int main(int argc, char* argv[])
 				}
 
 				// Match SNPs to bim
-				ref->match_bim(exposure->get_snp_names(), outcome->get_snp_names(), true);
+				if (!ref_shm)
+					ref->match_bim(exposure->get_snp_names(), outcome->get_snp_names(), true);
 				ref->sanitise_list();
 
 				if (maf > 0.0) {
@@ -469,7 +777,9 @@ int main(int argc, char* argv[])
 				}
 
 				// Do the related conditional and colocalisation analyses
-				if (pwcoco_sub(exposure, outcome, ref, p_cutoff1, p_cutoff2, collinear, ld_window, out, top_snp, freq_threshold, cond_ssize, out_cond, p1, p2, p3, verbose)) {
+				// Pairs sharing SNPs with the previous one keep its LD
+				ld->begin_pair(ref);
+				if (pwcoco_sub(exposure, outcome, ref, ld, precision_check, p_cutoff1, p_cutoff2, collinear, collapse_r2, ld_window, out, top_snp, freq_threshold, cond_ssize, out_cond, p1, p2, p3, pp_grid, verbose)) {
 					continue;
 				}
 			}
@@ -485,26 +795,45 @@ int main(int argc, char* argv[])
 			return 1;
 		}
 
-		if (initial_coloc(exposure, outcome, out, p1, p2, p3, init_h4)) {
+		if (initial_coloc(exposure, outcome, out, p1, p2, p3, pp_grid, init_h4)) {
 			return 0;
 		}
 
-		// Bim-related first
-		if (ref->read_bimfile(bim_file) == 0) {
-			return 0;
+		if (use_shm) {
+			ref_shm.reset(new shared_reference(ref_shm_name, ref_shm_keep));
+			if (!ref_shm->attach(bim_file, bed_file, fam_file, chr, out)) {
+				ref_shm.reset();
+			}
 		}
-		// In case 2, we only need those SNPs which have already been matched between the exposure and the outcome
-		ref->match_bim(exposure->get_snp_names(), outcome->get_snp_names(), false);
-		ref->sanitise_list();
 
-		// Fam-related
-		if (ref->read_famfile(fam_file) == 0) {
-			return 0;
+		if (ref_shm) {
+			ref_shm->match(ref, exposure->get_snp_names(), outcome->get_snp_names());
+			ref->sanitise_list();
 		}
+		else if (ld_mat) {
+			// The LD matrix carries the SNP information and frequencies
+			ld_mat->fill_reference(ref);
+			ref->match_bim(exposure->get_snp_names(), outcome->get_snp_names(), true);
+			ref->sanitise_list();
+		}
+		else {
+			// Bim-related first
+			if (ref->read_bimfile(bim_file) == 0) {
+				return 0;
+			}
+			// In case 2, we only need those SNPs which have already been matched between the exposure and the outcome
+			ref->match_bim(exposure->get_snp_names(), outcome->get_snp_names(), false);
+			ref->sanitise_list();
 
-		// Finally bed-related
-		if (ref->read_bedfile(bed_file) == 0) {
-			return 0;
+			// Fam-related
+			if (ref->read_famfile(fam_file) == 0) {
+				return 0;
+			}
+
+			// Finally bed-related
+			if (ref->read_bedfile(bed_file) == 0) {
+				return 0;
+			}
 		}
 		//ref->calculate_allele_freq();
 		if (maf > 0.0) {
@@ -513,10 +842,14 @@ int main(int argc, char* argv[])
 		}
 
 		// Do the related conditional and colocalisation analyses
-		if (pwcoco_sub(exposure, outcome, ref, p_cutoff1, p_cutoff2, collinear, ld_window, out, top_snp, freq_threshold, cond_ssize, out_cond, p1, p2, p3, verbose)) {
+		ld->begin_pair(ref);
+		if (pwcoco_sub(exposure, outcome, ref, ld, precision_check, p_cutoff1, p_cutoff2, collinear, collapse_r2, ld_window, out, top_snp, freq_threshold, cond_ssize, out_cond, p1, p2, p3, pp_grid, verbose)) {
+			ld->flush();
 			return 0;
 		}
 	}
+	ld->flush();
+	ref_shm.reset(); // Detaches, removing the segment if this was its last user
 
 #ifdef PYTHON_INC
 	Py_Finalize();
@@ -537,56 +870,66 @@ int main(int argc, char* argv[])
  * @param double init_h4 H4 threshold
  * @ret int
  */
-int initial_coloc(phenotype *exposure, phenotype *outcome, string out, double p1, double p2, double p3, double init_h4)
+int initial_coloc(phenotype *exposure, phenotype *outcome, string out, double p1, double p2, double p3, const vector<coloc_prior> &pp_grid, double init_h4)
 {
 	// First pass through - match data and perform coloc
 	mdata *matched = new mdata(exposure, outcome);
 	coloc_analysis *initial_coloc = new coloc_analysis(matched, out, p1, p2, p3);
+	initial_coloc->set_prior_grid(&pp_grid);
+
+	int stop = 0;
 
 	if (initial_coloc->num_snps() == 0) {
 		spdlog::info("Stopping algorthim as no SNPs included in initial colocalisation analysis.");
-		return 1;
+		stop = 1;
 	}
+	else {
+		initial_coloc->init_coloc(exposure->get_phenoname(), outcome->get_phenoname());
 
-	initial_coloc->init_coloc(exposure->get_phenoname(), outcome->get_phenoname());
-
-	if (initial_coloc->pp_abf[H4] > init_h4) {
-		spdlog::info("Stopping algorthim as H4 for initial colocalisation analysis is already at or above threshold ({}%).", init_h4 * 100);
-		return 1;
+		if (initial_coloc->pp_abf[H4] > init_h4) {
+			spdlog::info("Stopping algorthim as H4 for initial colocalisation analysis is already at or above threshold ({}%).", init_h4 * 100);
+			stop = 1;
+		}
 	}
 
 	delete(initial_coloc);
-	return 0;
+	delete(matched);
+	return stop;
 }
 
 /*
  * Common function to run the subsequent conditional and colocalisation analyses
  */
-int pwcoco_sub(phenotype *exposure, phenotype *outcome, reference *ref, double p_cutoff1, double p_cutoff2, double collinear, double ld_window, string out, double top_snp,
-	double freq_threshold, double cond_ssize, bool out_cond, double p1, double p2, double p3, bool verbose)
+int pwcoco_sub(phenotype *exposure, phenotype *outcome, reference *ref, locus_ld *ld, bool precision_check, double p_cutoff1, double p_cutoff2, double collinear, double collapse_r2, double ld_window, string out, double top_snp,
+	double freq_threshold, double cond_ssize, bool out_cond, double p1, double p2, double p3, const vector<coloc_prior> &pp_grid, bool verbose)
 {
 	// Holder for the conditional matrices
 	conditional_dat *exp_cdat = new conditional_dat();
 	conditional_dat *out_cdat = new conditional_dat();
 
 	// Find each independent SNPs for both exposure and outcome data
-	cond_analysis *exp_analysis = new cond_analysis(p_cutoff1, collinear, ld_window, out, top_snp, freq_threshold, exposure->get_phenoname(), cond_ssize, verbose);
-	exp_analysis->init_conditional(exposure, ref);
+	cond_analysis *exp_analysis = new cond_analysis(p_cutoff1, collinear, collapse_r2, ld_window, out, top_snp, freq_threshold, exposure->get_phenoname(), cond_ssize, verbose);
+	exp_analysis->init_conditional(exposure, ref, ld);
 	exp_analysis->find_independent_snps(exp_cdat, ref);
 
-	cond_analysis *out_analysis = new cond_analysis(p_cutoff2, collinear, ld_window, out, top_snp, freq_threshold, outcome->get_phenoname(), cond_ssize, verbose);
-	out_analysis->init_conditional(outcome, ref);
+	cond_analysis *out_analysis = new cond_analysis(p_cutoff2, collinear, collapse_r2, ld_window, out, top_snp, freq_threshold, outcome->get_phenoname(), cond_ssize, verbose);
+	out_analysis->init_conditional(outcome, ref, ld);
 	out_analysis->find_independent_snps(out_cdat, ref);
 
 	// If both of the conditionals failed - don't continue
 	if (exp_analysis->get_num_ind() == 0 && out_analysis->get_num_ind() == 0)
 	{
 		spdlog::warn("Both conditional analyses failed to run or find any conditionally independednt signals, and so no colocalisation will be run.");
+		delete(exp_analysis);
+		delete(out_analysis);
+		delete(exp_cdat);
+		delete(out_cdat);
 		return 1;
 	}
 
 	spdlog::info("There are {} selected SNPs in the exposure dataset and {} in the outcome dataset.", exp_analysis->get_num_ind(), out_analysis->get_num_ind());
-	spdlog::info("Performing {} conditional and colocalisation analyses.", (exp_analysis->get_num_ind() == 0 ? 1 : exp_analysis->get_num_ind()) * (out_analysis->get_num_ind() == 0 ? 1 : out_analysis->get_num_ind()));
+	size_t k1 = exp_analysis->get_num_ind(), k2 = out_analysis->get_num_ind();
+	spdlog::info("Performing {} conditional and {} colocalisation analyses.", k1 + k2, (k1 + 1) * (k2 + 1) - 1);
 
 #ifdef PYTHON_INC
 	Py_Initialize();
@@ -595,61 +938,108 @@ int pwcoco_sub(phenotype *exposure, phenotype *outcome, reference *ref, double p
 	PyObject *path = PyObject_GetAttrString(sys, "path");
 #endif
 
-	// Perform PWCoCo!
-//#pragma omp parallel for
-	for (int i = 0; i < exp_analysis->get_num_ind() + 1; i++)
-	{
-		string exp_snp_name = "", out_snp_name = "";
-
-		if (i < exp_analysis->get_num_ind()) 
-		{
-			// New conditional data struct for parallelisation
-			conditional_dat *par_exp_cdat = new conditional_dat(*exp_cdat);
-
-			exp_analysis->pw_conditional(exp_analysis->get_num_ind() > 1 ? i : -1, out_cond, par_exp_cdat, ref); // Be careful not to remove the only independent SNP
-			exp_snp_name = exp_analysis->get_ind_snp_name(i);
+	// Condition on each independent signal once; the coloc grid below only reads these.
+	// Every task writes only to its own result, so both stages run across the threads
+	// and the coloc results are reported in grid order afterwards.
+	vector<cond_result> exp_res(k1), out_res(k2);
+#ifdef PYTHON_INC
+#pragma omp parallel for schedule(dynamic) if(!out_cond) // Locus plots go through the Python interpreter
+#else
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int t = 0; t < (int)(k1 + k2); t++) {
+		if (t < k1)
+			exp_analysis->pw_conditional(k1 > 1 ? t : -1, out_cond, exp_cdat, &exp_res[t], ref); // Be careful not to remove the only independent SNP
+		else
+			out_analysis->pw_conditional(k2 > 1 ? t - k1 : -1, out_cond, out_cdat, &out_res[t - k1], ref);
+	}
+	ld->log_stats();
+
+	// Perform PWCoCo! The last cell would be unconditioned against unconditioned
+	size_t num_cells = (k1 + 1) * (k2 + 1) - 1;
+	vector<coloc_analysis *> cells(num_cells, nullptr);
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < (int)num_cells; c++) {
+		size_t i = c / (k2 + 1), j = c % (k2 + 1);
+		mdata *matched_conditional;
+
+		if (i == k1)
+			matched_conditional = new mdata(&out_res[j], exposure);
+		else if (j == k2)
+			matched_conditional = new mdata(&exp_res[i], outcome);
+		else
+			matched_conditional = new mdata(&exp_res[i], &out_res[j]);
+
+		cells[c] = new coloc_analysis(matched_conditional, out, p1, p2, p3);
+		cells[c]->set_prior_grid(&pp_grid);
+		cells[c]->compute_coloc();
+		delete(matched_conditional);
+	}
 
-			delete(par_exp_cdat);
-		}
-		else if (i >= exp_analysis->get_num_ind())
-		{
-			exp_snp_name = "unconditioned";
-		}
+	for (size_t c = 0; c < num_cells; c++) {
+		size_t i = c / (k2 + 1), j = c % (k2 + 1);
+		string exp_snp_name = i < k1 ? exp_analysis->get_ind_snp_name(i) : "unconditioned",
+			out_snp_name = j < k2 ? out_analysis->get_ind_snp_name(j) : "unconditioned";
 
-		for (int j = 0; j < out_analysis->get_num_ind() + 1; j++)
-		{
-			if (j < out_analysis->get_num_ind())
-			{
-				conditional_dat *par_out_cdat = new conditional_dat(*out_cdat);
+		cells[c]->report_coloc(exp_snp_name, out_snp_name, exp_analysis->get_cond_name(), out_analysis->get_cond_name());
+		delete(cells[c]);
+	}
 
-				out_analysis->pw_conditional(out_analysis->get_num_ind() > 1 ? j : -1, out_cond, par_out_cdat, ref);
-				out_snp_name = out_analysis->get_ind_snp_name(j);
+	if (precision_check) {
+		check_precision(exposure, exp_analysis, exp_res, ref, ld, p_cutoff1, collinear, collapse_r2, ld_window, out, top_snp, freq_threshold, cond_ssize);
+		check_precision(outcome, out_analysis, out_res, ref, ld, p_cutoff2, collinear, collapse_r2, ld_window, out, top_snp, freq_threshold, cond_ssize);
+	}
 
-				delete(par_out_cdat);
-			}
-			else if (j >= out_analysis->get_num_ind())
-			{
-				out_snp_name = "unconditioned";
-			}
+	delete(exp_analysis);
+	delete(out_analysis);
+	delete(exp_cdat);
+	delete(out_cdat);
+	return 0;
+}
 
-			if (exp_snp_name == "unconditioned" && out_snp_name == "unconditioned")
-				continue;
+/*
+ * Repeats the conditional analyses of one trait with the LD rows of the selected SNPs
+ * taken in double rather than from the float Z rows, and logs the largest differences
+ * of the mixed-precision results from them.
+ */
+void check_precision(phenotype *pheno, cond_analysis *analysis, const vector<cond_result> &res, reference *ref, locus_ld *ld, double p_cutoff, double collinear, double collapse_r2,
+	double ld_window, string out, double top_snp, double freq_threshold, bool cond_ssize)
+{
+	conditional_dat cdat;
+	cond_analysis check(p_cutoff, collinear, collapse_r2, ld_window, out, top_snp, freq_threshold, pheno->get_phenoname(), cond_ssize, false);
+	size_t k = analysis->get_num_ind();
+	double max_b = 0.0, max_se = 0.0, max_logp = 0.0;
+	bool same;
+
+	check.set_exact_z(true);
+	check.init_conditional(pheno, ref, ld);
+	check.find_independent_snps(&cdat, ref);
+
+	same = (check.get_num_ind() == k);
+	for (size_t i = 0; same && i < k; i++)
+		same = (check.get_ind_snp_name(i) == analysis->get_ind_snp_name(i));
+	if (!same) {
+		spdlog::warn("[{}] Mixed precision selected different SNPs from double precision ({} against {}).", analysis->get_cond_name(), k, check.get_num_ind());
+		return;
+	}
 
-			mdata *matched_conditional;
-			if (exp_snp_name == "unconditioned")
-				matched_conditional = new mdata(out_analysis, exposure);
-			else if (out_snp_name == "unconditioned")
-				matched_conditional = new mdata(exp_analysis, outcome);
-			else
-				matched_conditional = new mdata(exp_analysis, out_analysis);
+	vector<cond_result> check_res(k);
+#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < (int)k; t++)
+		check.pw_conditional(k > 1 ? t : -1, false, &cdat, &check_res[t], ref);
 
-			coloc_analysis *conditional_coloc = new coloc_analysis(matched_conditional, out, p1, p2, p3);
-			conditional_coloc->init_coloc(exp_snp_name, out_snp_name, exp_analysis->get_cond_name(), out_analysis->get_cond_name());
+	for (size_t i = 0; i < k; i++) {
+		for (size_t j = 0; j < res[i].b_cond.size() && j < check_res[i].b_cond.size(); j++) {
+			const cond_result &a = res[i], &b = check_res[i];
 
-			delete(matched_conditional);
-			delete(conditional_coloc);
+			max_b = max(max_b, fabs(a.b_cond[j] - b.b_cond[j]));
+			if (b.se_cond[j] > 0.0)
+				max_se = max(max_se, fabs(a.se_cond[j] / b.se_cond[j] - 1.0));
+			if (a.p_cond[j] > 0.0 && b.p_cond[j] > 0.0)
+				max_logp = max(max_logp, fabs(log10(a.p_cond[j]) - log10(b.p_cond[j])));
 		}
 	}
 
-	return 0;
+	spdlog::info("[{}] Largest difference of mixed from double precision: {:.3g} in beta, {:.3g} relative in SE and {:.3g} in log10(P).",
+		analysis->get_cond_name(), max_b, max_se, max_logp);
 }
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <memory>
 #include <omp.h>
 #include <time.h>
 #include <thread>
@@ -13,11 +14,19 @@
 #include "data.h"
 #include "conditional.h"
 #include "coloc.h"
+#include "coloc_scan.h"
+#include "coloc_screen.h"
 #include "helper_funcs.h"
+#include "ld_matrix.h"
+#include "locus_ld.h"
+#include "ref_shm.h"
+#include "server.h"
 
 using namespace std;
 namespace fs = std::filesystem;
 
-int initial_coloc(phenotype *exposure, phenotype *outcome, string out, double p1, double p2, double p3, double init_h4);
-int pwcoco_sub(phenotype *exposure, phenotype *outcome, reference *ref, double p_cutoff1, double p_cutoff2, double collinear, double ld_window, string out, double top_snp,
-	double freq_threshold, double cond_ssize, bool out_cond, double p1, double p2, double p3, bool verbose);
+int initial_coloc(phenotype *exposure, phenotype *outcome, string out, double p1, double p2, double p3, const vector<coloc_prior> &pp_grid, double init_h4);
+int pwcoco_sub(phenotype *exposure, phenotype *outcome, reference *ref, locus_ld *ld, bool precision_check, double p_cutoff1, double p_cutoff2, double collinear, double collapse_r2, double ld_window, string out, double top_snp,
+	double freq_threshold, double cond_ssize, bool out_cond, double p1, double p2, double p3, const vector<coloc_prior> &pp_grid, bool verbose);
+void check_precision(phenotype *pheno, cond_analysis *analysis, const vector<cond_result> &res, reference *ref, locus_ld *ld, double p_cutoff, double collinear, double collapse_r2,
+	double ld_window, string out, double top_snp, double freq_threshold, bool cond_ssize);
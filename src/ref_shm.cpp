@@ -0,0 +1,363 @@
+#include "ref_shm.h"
+
+shared_reference::shared_reference(const string &name, bool keep)
+{
+	this->name = name[0] == '/' ? name : "/" + name;
+	this->keep = keep;
+	fd = -1;
+	base = nullptr;
+	size = 0;
+	head = nullptr;
+}
+
+/*
+ * Detaches from the segment, removing it if no other process is attached and it is not kept.
+ */
+shared_reference::~shared_reference()
+{
+	if (base)
+		munmap((void *)base, size);
+	if (fd < 0)
+		return;
+
+	if (!keep && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		// Only remove the name if it still refers to this segment
+		struct stat ours, current;
+		int cur = shm_open(name.c_str(), O_RDONLY, 0);
+
+		if (cur >= 0 && fstat(fd, &ours) == 0 && fstat(cur, &current) == 0 && ours.st_ino == current.st_ino) {
+			shm_unlink(name.c_str());
+			spdlog::info("Removed the shared reference {} as no other process is using it.", name);
+		}
+		if (cur >= 0)
+			close(cur);
+	}
+	close(fd);
+}
+
+uint64_t shared_reference::name_hash(const char *s, size_t len)
+{
+	return fnv1a(s, len);
+}
+
+/*
+ * Identifies the reference files by their size and modification time, as for the LD cache.
+ * @ret uint64_t 0 if a file could not be read
+ */
+uint64_t shared_reference::fingerprint(const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr)
+{
+	error_code ec;
+	string id = to_string(chr) + ";";
+
+	for (const string &f : { bim_file, bed_file, fam_file }) {
+		uintmax_t fsize = fs::file_size(f, ec);
+		if (ec)
+			return 0;
+		id += to_string(fsize) + ":" + to_string(fs::last_write_time(f, ec).time_since_epoch().count()) + ";";
+	}
+	return max<uint64_t>(fnv1a(id.data(), id.size()), 1);
+}
+
+/*
+ * Attaches to the segment, publishing it first if no process has.
+ * @ret bool False if the shared reference cannot be used, in which case the reference
+ * should be read as usual
+ */
+bool shared_reference::attach(const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr, const string &out)
+{
+	uint64_t fp = fingerprint(bim_file, bed_file, fam_file, chr);
+	int attempt;
+
+	if (fp == 0) {
+		spdlog::warn("Could not read the reference files to fingerprint them; the reference will not be shared.");
+		return false;
+	}
+
+	for (attempt = 0; attempt < 100; attempt++) {
+		fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+		if (fd >= 0) {
+			struct stat st;
+
+			flock(fd, LOCK_SH); // Waits for a publisher still writing it
+			if (map_segment()) {
+				if (head->fingerprint != fp) {
+					spdlog::warn("Shared reference {} was built from other reference files or another --chr; the reference will not be shared.", name);
+					munmap((void *)base, size);
+					base = nullptr;
+					close(fd);
+					fd = -1;
+					return false;
+				}
+				spdlog::info("Attached to the shared reference {} ({} SNPs, {} individuals).", name, head->snps, head->individuals);
+				return true;
+			}
+
+			// Incomplete. A publisher sizes the segment only while it holds the lock, so a sized
+			// one that can be locked was left by a publisher that died. An empty one may have
+			// only just been created, before its publisher could lock it, and is left alone
+			// unless it is older than any publisher takes to lock it.
+			if (fstat(fd, &st) == 0 && (st.st_size > 0 || time(nullptr) - st.st_ctime > stale_secs) &&
+				flock(fd, LOCK_EX | LOCK_NB) == 0) {
+				spdlog::warn("Removing the incomplete shared reference {} left by a process that has died.", name);
+				shm_unlink(name.c_str());
+			}
+			close(fd);
+			fd = -1;
+			this_thread::sleep_for(chrono::milliseconds(100));
+			continue;
+		}
+		if (errno != ENOENT)
+			break;
+
+		fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			if (errno == EEXIST)
+				continue; // Another process got there first
+			break;
+		}
+
+		flock(fd, LOCK_EX);
+		if (!publish(bim_file, bed_file, fam_file, chr, out)) {
+			shm_unlink(name.c_str());
+			close(fd);
+			fd = -1;
+			return false;
+		}
+		flock(fd, LOCK_SH);
+
+		if (map_segment() && head->fingerprint == fp)
+			return true;
+		break;
+	}
+
+	if (attempt == 100)
+		spdlog::warn("Gave up waiting for another process to publish the shared reference {}; the reference will not be shared.", name);
+	else
+		spdlog::warn("Could not open the shared reference {}: {}; the reference will not be shared.", name, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+	return false;
+}
+
+/*
+ * Maps the segment read-only.
+ * @ret bool True if it is complete
+ */
+bool shared_reference::map_segment()
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header))
+		return false;
+
+	size = st.st_size;
+	void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return false;
+
+	base = (const char *)p;
+	head = at<header>(0);
+	if (memcmp(head->magic, shm_magic, 8) != 0 || head->ready != 1 || head->size != size) {
+		munmap(p, size);
+		base = nullptr;
+		head = nullptr;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Reads the whole reference, as for folders, and writes it into the segment.
+ * @ret bool True if the segment is complete
+ */
+bool shared_reference::publish(const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr, const string &out)
+{
+	reference *panel = new reference(out, chr);
+	uint64_t i, j, n, ind, words, table_size = 1, strings = 0, off;
+
+	spdlog::info("Publishing the reference to the shared memory segment {}.", name);
+	if (panel->read_bimfile(bim_file) == 0) {
+		delete(panel);
+		return false;
+	}
+	panel->whole_bim();
+	panel->sanitise_list();
+	if (panel->read_famfile(fam_file) == 0 || panel->read_bedfile(bed_file) == 0) {
+		delete(panel);
+		return false;
+	}
+
+	// Names after sanitise_list, so duplicates are already renamed as in --serve
+	const vector<string> &names = panel->bim_snp_name;
+	n = names.size();
+	ind = panel->individuals;
+	words = (ind + 63) / 64;
+	while (table_size < 2 * n)
+		table_size <<= 1;
+	for (i = 0; i < n; i++)
+		strings += names[i].size() + panel->bim_allele1[i].size() + panel->bim_allele2[i].size() + 3;
+
+	auto align = [](uint64_t x) { return (x + 63) & ~(uint64_t)63; };
+	header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, shm_magic, 8);
+	h.fingerprint = fingerprint(bim_file, bed_file, fam_file, chr);
+	h.snps = n;
+	h.individuals = ind;
+	h.words = words;
+	h.table_size = table_size;
+	off = align(sizeof(header));
+	h.off_chr = off; off = align(off + n * sizeof(uint16_t));
+	h.off_bp = off; off = align(off + n * sizeof(int32_t));
+	h.off_og = off; off = align(off + n * sizeof(uint64_t));
+	h.off_mu = off; off = align(off + n * sizeof(double));
+	h.off_name = off; off = align(off + n * sizeof(uint64_t));
+	h.off_a1 = off; off = align(off + n * sizeof(uint64_t));
+	h.off_a2 = off; off = align(off + n * sizeof(uint64_t));
+	h.off_strings = off; off = align(off + strings);
+	h.off_table = off; off = align(off + table_size * sizeof(uint64_t));
+	h.off_bed1 = off; off = align(off + n * words * sizeof(uint64_t));
+	h.off_bed2 = off; off = align(off + n * words * sizeof(uint64_t));
+	h.size = off;
+
+	// Reserve the memory now so that running out of it is an error rather than SIGBUS
+	if (posix_fallocate(fd, 0, h.size) != 0) {
+		spdlog::warn("Not enough shared memory for the reference ({} MB).", h.size / (1024 * 1024));
+		delete(panel);
+		return false;
+	}
+	char *w = (char *)mmap(nullptr, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (w == MAP_FAILED) {
+		delete(panel);
+		return false;
+	}
+
+	uint16_t *chr_w = (uint16_t *)(w + h.off_chr);
+	int32_t *bp_w = (int32_t *)(w + h.off_bp);
+	uint64_t *og_w = (uint64_t *)(w + h.off_og), *name_w = (uint64_t *)(w + h.off_name),
+		*a1_w = (uint64_t *)(w + h.off_a1), *a2_w = (uint64_t *)(w + h.off_a2),
+		*table_w = (uint64_t *)(w + h.off_table);
+	double *mu_w = (double *)(w + h.off_mu);
+	char *str_w = w + h.off_strings;
+	uint64_t pos = 0;
+
+	auto put_string = [&](const string &s) {
+		uint64_t at = pos;
+		memcpy(str_w + pos, s.c_str(), s.size() + 1);
+		pos += s.size() + 1;
+		return at;
+	};
+
+	for (i = 0; i < n; i++) {
+		chr_w[i] = panel->bim_chr[i];
+		bp_w[i] = panel->bim_bp[i];
+		og_w[i] = panel->bim_og_pos[i];
+		mu_w[i] = panel->mu[i];
+		name_w[i] = put_string(names[i]);
+		a1_w[i] = put_string(panel->bim_allele1[i]);
+		a2_w[i] = put_string(panel->bim_allele2[i]);
+
+		for (uint64_t s = name_hash(names[i].c_str(), names[i].size()) & (table_size - 1);; s = (s + 1) & (table_size - 1)) {
+			if (table_w[s] == 0) {
+				table_w[s] = i + 1;
+				break;
+			}
+			if (names[table_w[s] - 1] == names[i])
+				break;
+		}
+
+		uint64_t *row1 = (uint64_t *)(w + h.off_bed1) + i * words, *row2 = (uint64_t *)(w + h.off_bed2) + i * words;
+		for (j = 0; j < ind; j++) {
+			row1[j >> 6] |= (uint64_t)panel->bed_snp_1[i][j] << (j & 63);
+			row2[j >> 6] |= (uint64_t)panel->bed_snp_2[i][j] << (j & 63);
+		}
+	}
+	delete(panel);
+
+	memcpy(w, &h, sizeof(h)); // ready is still 0
+	((header *)w)->ready = 1;
+	munmap(w, h.size);
+
+	spdlog::info("Published {} SNPs and {} individuals to {} ({} MB).", n, ind, name, h.size / (1024 * 1024));
+	return true;
+}
+
+/*
+ * Index of a SNP by its name.
+ * @ret size_t npos if the SNP is not in the reference
+ */
+size_t shared_reference::find(const string &snp) const
+{
+	const uint64_t *table = at<uint64_t>(head->off_table), *name_off = at<uint64_t>(head->off_name);
+	const char *strings = at<char>(head->off_strings);
+	uint64_t mask = head->table_size - 1;
+
+	for (uint64_t s = name_hash(snp.c_str(), snp.size()) & mask; table[s] != 0; s = (s + 1) & mask) {
+		if (strcmp(strings + name_off[table[s] - 1], snp.c_str()) == 0)
+			return table[s] - 1;
+	}
+	return npos;
+}
+
+/*
+ * Copies the SNPs of a pair out of the segment into ref, as match_bim does from a whole reference.
+ * @ret void
+ */
+void shared_reference::match(reference *ref, vector<string> &names, vector<string> &names2) const
+{
+	vector<string> snp_names = names;
+	vector<size_t> pos;
+	const uint64_t *name_off = at<uint64_t>(head->off_name), *a1_off = at<uint64_t>(head->off_a1), *a2_off = at<uint64_t>(head->off_a2);
+	const char *strings = at<char>(head->off_strings);
+	size_t i, j, k, ind = head->individuals, words = head->words;
+
+	copy(names2.begin(), names2.end(), back_inserter(snp_names));
+	v_remove_dupes(snp_names);
+	for (i = 0; i < snp_names.size(); i++) {
+		size_t p = find(snp_names[i]);
+		if (p != npos)
+			pos.push_back(p);
+	}
+
+	ref->individuals = ind;
+	ref->fam_ids_inc.resize(ind);
+	iota(ref->fam_ids_inc.begin(), ref->fam_ids_inc.end(), 0);
+	ref->num_snps = head->snps;
+	ref->start_snps = head->snps ? at<uint64_t>(head->off_og)[0] : -1;
+	ref->end_snps = head->snps ? at<uint64_t>(head->off_og)[head->snps - 1] : -1;
+
+	k = pos.size();
+	ref->bim_read_pos.assign(pos.begin(), pos.end());
+	ref->bim_og_pos.resize(k);
+	ref->bim_snp_name.resize(k);
+	ref->bim_allele1.resize(k);
+	ref->bim_allele2.resize(k);
+	ref->bim_chr.resize(k);
+	ref->bim_bp.resize(k);
+	ref->mu.resize(k);
+	ref->bed_snp_1.assign(k, vector<bool>(ind));
+	ref->bed_snp_2.assign(k, vector<bool>(ind));
+	for (i = 0; i < k; i++) {
+		const uint64_t *row1 = at<uint64_t>(head->off_bed1) + pos[i] * words, *row2 = at<uint64_t>(head->off_bed2) + pos[i] * words;
+
+		ref->bim_og_pos[i] = at<uint64_t>(head->off_og)[pos[i]];
+		ref->bim_snp_name[i] = strings + name_off[pos[i]];
+		ref->bim_allele1[i] = strings + a1_off[pos[i]];
+		ref->bim_allele2[i] = strings + a2_off[pos[i]];
+		ref->bim_chr[i] = at<uint16_t>(head->off_chr)[pos[i]];
+		ref->bim_bp[i] = at<int32_t>(head->off_bp)[pos[i]];
+		ref->mu[i] = at<double>(head->off_mu)[pos[i]];
+		for (j = 0; j < ind; j++) {
+			ref->bed_snp_1[i][j] = (row1[j >> 6] >> (j & 63)) & 1;
+			ref->bed_snp_2[i][j] = (row2[j >> 6] >> (j & 63)) & 1;
+		}
+	}
+
+	ref->num_snps_matched = k;
+	ref->ref_A = ref->bim_allele1;
+	ref->other_A = ref->bim_allele2;
+
+	spdlog::info("Number of SNPs matched from the shared reference to the phenotype data: {}.", k);
+}
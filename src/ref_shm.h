@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "data.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+/*
+ * Decoded reference published in a named POSIX shared-memory segment (--ref_shm), so that
+ * every pwcoco process on a node reads the same copy of the .bim columns and genotypes
+ * instead of decoding its own. The first process to find no segment reads the whole
+ * reference and publishes it; later ones map it read-only and copy out only the SNPs of
+ * their pair.
+ *
+ * Each attached process holds a shared flock on the segment, which the kernel drops if the
+ * process dies, so the last one to detach can tell that it is last and remove the segment.
+ * The publisher holds the lock exclusively until the segment is complete; others attach
+ * read-only.
+ *
+ * Segment layout: header, then per-SNP chr, bp, .bim position, A1 frequency and string
+ * offsets, the names and alleles, an open-addressing table from SNP name to index, and
+ * the two genotype bit rows of each SNP.
+ */
+class shared_reference {
+public:
+	shared_reference(const string &name, bool keep);
+	~shared_reference();
+
+	bool attach(const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr, const string &out);
+	void match(reference *ref, vector<string> &names, vector<string> &names2) const;
+
+private:
+	struct header {
+		char magic[8];
+		uint64_t ready; /// Set last by the publisher
+		uint64_t fingerprint; /// Reference files and --chr the segment was built from
+		uint64_t snps, individuals, words; /// words: 64-bit words per genotype row
+		uint64_t table_size; /// Slots in the name table, a power of two
+		uint64_t off_chr, off_bp, off_og, off_mu, off_name, off_a1, off_a2, off_strings, off_table, off_bed1, off_bed2;
+		uint64_t size;
+	};
+
+	bool publish(const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr, const string &out);
+	bool map_segment();
+	uint64_t fingerprint(const string &bim_file, const string &bed_file, const string &fam_file, unsigned short chr);
+	size_t find(const string &snp) const;
+
+	template <typename T>
+	const T *at(uint64_t off) const {
+		return reinterpret_cast<const T *>(base + off);
+	}
+
+	static uint64_t name_hash(const char *s, size_t len);
+
+	string name; /// Segment name, with the leading slash
+	bool keep; /// Leave the segment for later processes when the last user detaches
+	int fd; /// Holds the shared lock while attached
+	const char *base; /// Read-only mapping of the segment
+	size_t size;
+	const header *head;
+
+	static constexpr const char *shm_magic = "PWCOREF1";
+	static constexpr size_t npos = (size_t)-1;
+	static constexpr time_t stale_secs = 5; /// Age after which an empty, unlocked segment is abandoned
+};
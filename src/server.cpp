@@ -0,0 +1,444 @@
+#include "options.h"
+#include "server.h"
+
+/*
+ * Reads the options of one job on top of the server's defaults.
+ * @param vector<string> args Command line of the job, without the program name
+ * @param string error Set to the reason if an option could not be read
+ * @ret bool True if every option was read
+ */
+bool parse_job_args(const vector<string> &args, serve_job &job, string &error)
+{
+	size_t i;
+
+	try {
+		for (i = 0; i < args.size(); i++) {
+			const string &opt = args[i];
+			size_t needs = (opt == "--out_cond" || opt == "--cond_ssize" || opt == "--verbose") ? 0 : opt == "--coloc_pp" ? 3 : 1;
+
+			if (needs > 0 && i + needs >= args.size()) {
+				error = "missing value for " + opt;
+				return false;
+			}
+
+			if (opt == "--phen1_file" || opt == "--sum_stats1")
+				job.phen1_file = args[++i];
+			else if (opt == "--phen2_file" || opt == "--sum_stats2")
+				job.phen2_file = args[++i];
+			else if (opt == "--pve_file1")
+				job.pve_file1 = args[++i];
+			else if (opt == "--pve_file2")
+				job.pve_file2 = args[++i];
+			else if (opt == "--out")
+				job.out = args[++i];
+			else if (opt == "--n1")
+				job.n1 = max(stod(args[++i]), 0.0);
+			else if (opt == "--n2")
+				job.n2 = max(stod(args[++i]), 0.0);
+			else if (opt == "--n1_case")
+				job.n1_case = max(stod(args[++i]), 0.0);
+			else if (opt == "--n2_case")
+				job.n2_case = max(stod(args[++i]), 0.0);
+			else if (opt == "--pve1")
+				job.pve1 = stod(args[++i]);
+			else if (opt == "--pve2")
+				job.pve2 = stod(args[++i]);
+			else if (opt == "--p_cutoff")
+				job.p_cutoff1 = job.p_cutoff2 = stod(args[++i]);
+			else if (opt == "--p_cutoff1")
+				job.p_cutoff1 = stod(args[++i]);
+			else if (opt == "--p_cutoff2")
+				job.p_cutoff2 = stod(args[++i]);
+			else if (opt == "--top_snp")
+				job.top_snp = min(max(stod(args[++i]), 1.0), 10000.0);
+			else if (opt == "--ld_window")
+				job.ld_window = min(stoi(args[++i]), 10000) * 1000.0;
+			else if (opt == "--collinear")
+				job.collinear = min(max(stod(args[++i]), 0.01), 0.99);
+			else if (opt == "--collapse_r2")
+				job.collapse_r2 = min(max(stod(args[++i]), 0.0), 1.0);
+			else if (opt == "--freq_threshold")
+				job.freq_threshold = min(max(stod(args[++i]), 0.0), 1.0);
+			else if (opt == "--init_h4")
+				job.init_h4 = min(max(stod(args[++i]), 0.0), 100.0);
+			else if (opt == "--coloc_pp") {
+				job.p1 = min(max(stod(args[++i]), 1e-50), 1.0);
+				job.p2 = min(max(stod(args[++i]), 1e-50), 1.0);
+				job.p3 = min(max(stod(args[++i]), 1e-50), 1.0);
+			}
+			else if (opt == "--out_cond")
+				job.out_cond = true;
+			else if (opt == "--cond_ssize")
+				job.cond_ssize = true;
+			else if (opt == "--verbose")
+				job.verbose = job.out_cond = true;
+			else {
+				error = opt + " cannot be set for a single job";
+				return false;
+			}
+		}
+	}
+	catch (const exception &) {
+		error = "could not read the value of " + args[i];
+		return false;
+	}
+
+	if (job.phen1_file.empty() || job.phen2_file.empty()) {
+		error = "both --sum_stats1 and --sum_stats2 must be given";
+		return false;
+	}
+	return true;
+}
+
+pwcoco_server::pwcoco_server(const string &socket_path, reference *panel, matrix_ld *ld_mat, const serve_job &defaults,
+	int workers, int threads, double ld_sketch, double maf, unsigned short chr)
+{
+	this->socket_path = socket_path;
+	this->panel = panel;
+	this->ld_mat = ld_mat;
+	this->defaults = defaults;
+	this->workers = max(workers, 1);
+	this->job_threads = max(threads / this->workers, 1);
+	this->ld_sketch = ld_sketch;
+	this->maf = maf;
+	this->chr = chr;
+	listen_fd = -1;
+	stopping = false;
+}
+
+/*
+ * Listens on the socket and hands each request to the workers until a client asks
+ * the server to stop.
+ * @ret int 0 if the server stopped cleanly, 1 if it could not start
+ */
+int pwcoco_server::serve()
+{
+	sockaddr_un addr;
+	vector<thread> pool;
+
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		spdlog::critical("Socket path {} is too long.", socket_path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path.c_str());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		spdlog::critical("Could not create a socket: {}.", strerror(errno));
+		return 1;
+	}
+
+	// A socket that nothing answers on was left by a server that did not shut down
+	if (connect(listen_fd, (sockaddr *)&addr, sizeof(addr)) == 0) {
+		spdlog::critical("Another server is already listening on {}.", socket_path);
+		close(listen_fd);
+		return 1;
+	}
+	close(listen_fd);
+	if (fs::is_socket(socket_path)) {
+		unlink(socket_path.c_str());
+	}
+	else if (fs::exists(socket_path)) {
+		spdlog::critical("{} already exists and is not a socket.", socket_path);
+		return 1;
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0) {
+		spdlog::critical("Could not listen on {}: {}.", socket_path, strerror(errno));
+		close(listen_fd);
+		return 1;
+	}
+	spdlog::info("Serving PWCoCo jobs on {} with {} workers of {} threads each.", socket_path, workers, job_threads);
+
+	for (int w = 0; w < workers; w++)
+		pool.emplace_back(&pwcoco_server::worker, this);
+
+	vector<connection> reading;
+	bool stop = false;
+
+	while (!stop) {
+		vector<pollfd> fds(1 + reading.size());
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		int wait_ms = -1;
+		size_t c, kept = 0;
+
+		// Sleep until something arrives or the earliest deadline passes
+		fds[0] = { listen_fd, POLLIN, 0 };
+		for (c = 0; c < reading.size(); c++) {
+			int left = max((int)chrono::duration_cast<chrono::milliseconds>(reading[c].deadline - now).count() + 1, 0);
+			fds[c + 1] = { reading[c].fd, POLLIN, 0 };
+			wait_ms = wait_ms < 0 ? left : min(wait_ms, left);
+		}
+		if (poll(fds.data(), fds.size(), wait_ms) < 0) {
+			if (errno == EINTR)
+				continue;
+			spdlog::error("Could not wait for connections on {}: {}.", socket_path, strerror(errno));
+			break;
+		}
+
+		now = chrono::steady_clock::now();
+		for (c = 0; c < reading.size(); c++) {
+			vector<string> args;
+			string error;
+			int state = (!stop && fds[c + 1].revents) ? read_request(reading[c], args, error) : 0;
+
+			if (state == 0 && !stop && now >= reading[c].deadline) {
+				error = "no complete request within " + to_string(request_timeout) + " secs";
+				state = -1;
+			}
+
+			if (state == 0) {
+				reading[kept++] = std::move(reading[c]);
+			}
+			else if (state < 0) {
+				spdlog::error("Rejected a request: {}.", error);
+				reply(reading[c].fd, "ERROR " + error + "\n");
+			}
+			else if (args.size() == 1 && args[0] == "--stop") {
+				spdlog::info("Stop requested; finishing the queued jobs.");
+				reply(reading[c].fd, "OK stopping\n");
+				stop = true;
+			}
+			else {
+				lock_guard<mutex> guard(queue_lock);
+				pending.push_back(make_pair(reading[c].fd, std::move(args)));
+				queue_ready.notify_one();
+			}
+		}
+		reading.resize(kept);
+
+		if (!stop && (fds[0].revents & POLLIN)) {
+			int fd = accept(listen_fd, nullptr, nullptr);
+			if (fd >= 0) {
+				reading.push_back({ fd, "", now + chrono::seconds(request_timeout) });
+			}
+			else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+				spdlog::error("Could not accept a connection on {}: {}.", socket_path, strerror(errno));
+				break;
+			}
+		}
+	}
+
+	for (auto &conn : reading)
+		reply(conn.fd, "ERROR the server is stopping\n");
+
+	{
+		lock_guard<mutex> guard(queue_lock);
+		stopping = true;
+	}
+	queue_ready.notify_all();
+	for (auto &t : pool)
+		t.join();
+
+	close(listen_fd);
+	unlink(socket_path.c_str());
+	spdlog::info("Server on {} has stopped.", socket_path);
+	return 0;
+}
+
+/*
+ * Takes requests off the queue until the server stops; queued jobs are finished first.
+ */
+void pwcoco_server::worker()
+{
+#if defined(_OPENMP)
+	omp_set_num_threads(job_threads);
+#endif
+
+	while (true) {
+		pair<int, vector<string>> request;
+		{
+			unique_lock<mutex> guard(queue_lock);
+			queue_ready.wait(guard, [this] { return stopping || !pending.empty(); });
+			if (pending.empty())
+				return;
+			request = std::move(pending.front());
+			pending.pop_front();
+		}
+		handle(request.first, request.second);
+	}
+}
+
+/*
+ * Reads what a client has sent so far, without waiting for more. A request is the lines up
+ * to the empty line that ends it; one longer than max_request bytes is turned away.
+ * @param string error Set to the reason if the request failed
+ * @ret int 1 if the request is complete, 0 if more is to come, -1 if it failed
+ */
+int pwcoco_server::read_request(connection &conn, vector<string> &args, string &error)
+{
+	string line;
+	char buf[4096];
+	ssize_t got;
+
+	while ((got = recv(conn.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		conn.request.append(buf, got);
+		if (conn.request.size() > max_request) {
+			error = "request is larger than " + to_string(max_request) + " bytes";
+			return -1;
+		}
+	}
+
+	if (conn.request.find("\n\n") == string::npos) {
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+		error = got == 0 ? "connection closed before the end of the request" : strerror(errno);
+		return -1;
+	}
+
+	istringstream ss(conn.request);
+	while (getline(ss, line) && !line.empty())
+		args.push_back(line);
+	return 1;
+}
+
+/*
+ * Answers the client and closes its connection.
+ */
+void pwcoco_server::reply(int fd, const string &msg)
+{
+	send(fd, msg.c_str(), msg.size(), MSG_NOSIGNAL); // The client may have gone
+	close(fd);
+}
+
+/*
+ * Runs one request and answers the client.
+ */
+void pwcoco_server::handle(int fd, const vector<string> &args)
+{
+	string error;
+
+	chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	serve_job job = defaults;
+
+	if (!parse_job_args(args, job, error) || !run_job(job, error)) {
+		spdlog::error("Job for {} failed: {}.", job.out, error);
+		reply(fd, "ERROR " + error + "\n");
+	}
+	else {
+		chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		double secs = (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0;
+		spdlog::info("Job for {} finished in {} secs.", job.out, secs);
+		reply(fd, "OK " + to_string(secs) + "\n");
+	}
+}
+
+/*
+ * Runs PWCoCo on one pair of files against the resident reference, as for a pair of files
+ * given on the command line.
+ * @ret bool False if the job could not be run
+ */
+bool pwcoco_server::run_job(const serve_job &job, string &error)
+{
+	phenotype *exposure = init_pheno(job.phen1_file, fs::path(job.phen1_file).filename().string(), job.n1, job.n1_case, job.pve1, job.pve_file1);
+	phenotype *outcome = init_pheno(job.phen2_file, fs::path(job.phen2_file).filename().string(), job.n2, job.n2_case, job.pve2, job.pve_file2);
+	bool ok = true;
+
+	if (exposure->has_failed() || outcome->has_failed()) {
+		error = "reading of the summary statistic files has failed";
+		ok = false;
+	}
+	else if (initial_coloc(exposure, outcome, job.out, job.p1, job.p2, job.p3, job.pp_grid, job.init_h4 / 100) == 0) {
+		reference *ref = new reference(job.out, chr);
+
+		ref->match_bim(*panel, exposure->get_snp_names(), outcome->get_snp_names());
+		ref->sanitise_list();
+
+		if (maf > 0.0 && ref->filter_snp_maf(maf) == 0) {
+			error = "no SNPs are left after MAF filtering";
+			ok = false;
+		}
+		else {
+			ld_source *source;
+			if (ld_mat)
+				source = ld_mat;
+			else if (ld_sketch > 0)
+				source = new sketch_ld((size_t)ld_sketch, job.collinear);
+			else
+				source = new genotype_ld();
+
+			locus_ld *ld = new locus_ld(source);
+			ld->begin_pair(ref);
+			pwcoco_sub(exposure, outcome, ref, ld, false, job.p_cutoff1, job.p_cutoff2, job.collinear, job.collapse_r2, job.ld_window, job.out, job.top_snp,
+				job.freq_threshold, job.cond_ssize, job.out_cond, job.p1, job.p2, job.p3, job.pp_grid, job.verbose);
+
+			delete(ld);
+			if (source != ld_mat)
+				delete(source);
+		}
+		delete(ref);
+	}
+
+	delete(exposure);
+	delete(outcome);
+	return ok;
+}
+
+/*
+ * Sends a job to a --serve process and waits for it to finish (--submit). Paths are made
+ * absolute first as the server may run from another directory.
+ * @param vector<string> args Command line of the job, without --submit and its socket
+ * @ret int 0 if the job ran, 1 otherwise
+ */
+int submit_job(const string &socket_path, const vector<string> &args)
+{
+	sockaddr_un addr;
+	string request, reply;
+	bool has_out = false;
+	char buf[4096];
+	ssize_t got;
+
+	for (size_t i = 0; i < args.size(); i++) {
+		request += args[i] + "\n";
+		if ((args[i] == "--sum_stats1" || args[i] == "--sum_stats2" || args[i] == "--phen1_file" || args[i] == "--phen2_file" ||
+			args[i] == "--pve_file1" || args[i] == "--pve_file2" || args[i] == "--out") && i + 1 < args.size()) {
+			has_out = has_out || args[i] == "--out";
+			request += fs::absolute(args[++i]).string() + "\n";
+		}
+	}
+	if (!has_out && !(args.size() == 1 && args[0] == "--stop"))
+		request += "--out\n" + fs::absolute("pwcoco_out").string() + "\n";
+	request += "\n";
+
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		spdlog::critical("Socket path {} is too long.", socket_path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+		spdlog::critical("Could not connect to a PWCoCo server on {}: {}.", socket_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+
+	for (size_t sent = 0; sent < request.size();) {
+		ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			spdlog::critical("Could not send the job to {}: {}.", socket_path, strerror(errno));
+			close(fd);
+			return 1;
+		}
+		sent += n;
+	}
+
+	while ((got = read(fd, buf, sizeof(buf))) > 0)
+		reply.append(buf, got);
+	close(fd);
+
+	while (!reply.empty() && reply.back() == '\n')
+		reply.pop_back();
+	if (reply.compare(0, 2, "OK") != 0) {
+		spdlog::critical("Job failed on the server: {}", reply.empty() ? "no reply" : reply);
+		return 1;
+	}
+	spdlog::info("Job finished on the server: {}", reply);
+	return 0;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "coloc.h"
+#include "ld_matrix.h"
+#include "locus_ld.h"
+
+using namespace std;
+
+/*
+ * Settings of one PWCoCo job. Reference-wide settings (the reference files, --chr, --maf
+ * and how LD is computed) are fixed when the server starts; the rest start from the
+ * server's own command line and can be overridden by each job.
+ */
+struct serve_job {
+	string phen1_file, phen2_file, pve_file1, pve_file2, out;
+	double n1, n2, n1_case, n2_case, pve1, pve2;
+	double p_cutoff1, p_cutoff2, collinear, collapse_r2, ld_window, freq_threshold, init_h4, top_snp;
+	double p1, p2, p3;
+	bool out_cond, cond_ssize, verbose;
+	vector<coloc_prior> pp_grid;
+};
+
+bool parse_job_args(const vector<string> &args, serve_job &job, string &error);
+
+/*
+ * Resident reference server (--serve).
+ *
+ * The reference is read once, whole, and kept read-only; each job takes its own copy of
+ * the SNPs its pair needs, so jobs run side by side on a pool of worker threads that
+ * split the OpenMP threads between them. Jobs arrive over a Unix domain socket as the
+ * newline-separated command line of a --submit client, ended by an empty line, and the
+ * client is answered with one line once its job has finished: "OK <secs>" or "ERROR <reason>".
+ * The listening thread reads every open connection at once with poll, so a slow client
+ * never holds up the others or a stop request; a client has request_timeout seconds in
+ * all to send up to max_request bytes.
+ */
+class pwcoco_server {
+public:
+	pwcoco_server(const string &socket_path, reference *panel, matrix_ld *ld_mat, const serve_job &defaults,
+		int workers, int threads, double ld_sketch, double maf, unsigned short chr);
+
+	int serve();
+
+private:
+	/*
+	 * Connection whose request is still being read.
+	 */
+	struct connection {
+		int fd;
+		string request; /// Bytes read so far
+		chrono::steady_clock::time_point deadline; /// When the whole request must have arrived
+	};
+
+	void worker();
+	int read_request(connection &conn, vector<string> &args, string &error);
+	void reply(int fd, const string &msg);
+	void handle(int fd, const vector<string> &args);
+	bool run_job(const serve_job &job, string &error);
+
+	string socket_path;
+	reference *panel; /// Whole reference, only read once the server is up
+	matrix_ld *ld_mat; /// Shared precomputed LD, if given in place of the genotypes
+	serve_job defaults;
+	int workers; /// Jobs run at the same time
+	int job_threads; /// OpenMP threads given to each job
+	double ld_sketch;
+	double maf;
+	unsigned short chr;
+
+	int listen_fd;
+	deque<pair<int, vector<string>>> pending; /// Accepted connections and their requests waiting for a worker
+	mutex queue_lock;
+	condition_variable queue_ready;
+	bool stopping;
+
+	static constexpr int request_timeout = 10; /// Seconds a client has to send its whole request
+	static constexpr size_t max_request = 64 * 1024; /// Largest request read, in bytes
+};
+
+int submit_job(const string &socket_path, const vector<string> &args);
@@ -0,0 +1,84 @@
+#include "conditional.h"
+#include "locus_ld.h"
+#include "test_utils.h"
+
+/*
+ * The collinearity prescreen only saves work: it must never reject a candidate that the
+ * full check in insert_B_Z would accept, in either precision of the Z rows. Each candidate
+ * is tried with the cut-off set exactly to its own collinearity, the hardest case, where
+ * insert_B_Z just accepts it, and again with a cut-off clearly below it, where both reject.
+ */
+struct cond_analysis_test {
+	static void check_prescreen(cond_analysis &ca, reference *ref, const vector<size_t> &selected, size_t &tried, size_t &rejected)
+	{
+		conditional_dat cdat;
+
+		ca.a_collinear = 1.0;
+		CHECK(ca.init_b(selected, &cdat, ref));
+		ca.init_z(selected, &cdat, ref);
+		for (size_t j = 0; j < ca.to_include.size(); j++) {
+			if (find(selected.begin(), selected.end(), j) != selected.end())
+				continue;
+
+			// Collinearity of the enlarged set, as insert_B_Z computes it
+			conditional_dat trial = cdat;
+			vector<size_t> ix(selected);
+			double collinearity = 0.0;
+
+			ca.a_collinear = 1.0;
+			if (!ca.insert_B_Z(selected, j, &trial, ref))
+				continue; // Fails the conditioning checks whatever the cut-off
+			ix.push_back(j);
+			stable_sort(ix.begin(), ix.end());
+			for (size_t d = 0; d < ix.size(); d++)
+				collinearity = max(collinearity, 1 - 1 / (ca.msx_b[ix[d]] * trial.B_i.coeff(d, d)));
+
+			ca.a_collinear = collinearity;
+			trial = cdat;
+			CHECK(!ca.collinear_prescreen(selected, j, &trial));
+			CHECK(ca.insert_B_Z(selected, j, &trial, ref));
+
+			ca.a_collinear = collinearity - 1e-3;
+			trial = cdat;
+			bool pre = ca.collinear_prescreen(selected, j, &trial);
+			CHECK(!(pre && ca.insert_B_Z(selected, j, &trial, ref)));
+
+			tried++;
+			rejected += pre;
+		}
+		ca.a_collinear = 1.0;
+	}
+};
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+	test_dir dir("pwcoco_test_collinear_prescreen");
+	string prefix = dir.file("ref"), exp_file = dir.file("exp.txt"), out_file = dir.file("out.txt");
+	size_t tried = 0, rejected = 0;
+
+	// Strong LD along one block, so that many candidates sit near the collinearity cut-off
+	synth_panel panel(2000, { 120 }, 0.985, 1000000, 21);
+	panel.write_plink(prefix);
+	panel.write_sumstats(exp_file, { { 30, 0.2 }, { 90, -0.2 } }, 22);
+	panel.write_sumstats(out_file, { { 60, 0.2 } }, 23);
+
+	phenotype *exposure = init_pheno(exp_file, "exp", 0, 0, 0, ""), *outcome = init_pheno(out_file, "out", 0, 0, 0, "");
+	reference ref(dir.file("res"), 0);
+	CHECK(load_reference(&ref, prefix, exposure, outcome));
+
+	genotype_ld source;
+	locus_ld ld(&source);
+	ld.begin_pair(&ref);
+	cond_analysis ca(5e-8, 0.9, 0.0, 1e5, dir.file("res"), 1e10, 0.2, "test", false, false);
+	ca.init_conditional(exposure, &ref, &ld);
+	cond_analysis_test::check_prescreen(ca, &ref, { 10, 50, 100 }, tried, rejected);
+	CHECK(tried > 50);
+	CHECK(rejected > 0);
+
+	delete(exposure);
+	delete(outcome);
+	if (test_failures > 0)
+		fprintf(stderr, "%d checks failed\n", test_failures);
+	return test_failures > 0;
+}
@@ -0,0 +1,46 @@
+#include "coloc.h"
+#include "test_utils.h"
+
+/*
+ * The .coloc_grid file is only written when --coloc_pp_grid gives priors to evaluate.
+ */
+static void run_coloc(phenotype *exposure, phenotype *outcome, const string &out, const vector<coloc_prior> *grid)
+{
+	mdata matched(exposure, outcome);
+	coloc_analysis coloc(&matched, out, 1e-4, 1e-4, 1e-5);
+
+	if (grid)
+		coloc.set_prior_grid(grid);
+	coloc.init_coloc(exposure->get_phenoname(), outcome->get_phenoname());
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+	test_dir dir("pwcoco_test_coloc_grid");
+	string exp_file = dir.file("exp.txt"), out_file = dir.file("out.txt");
+
+	synth_panel panel(1000, { 50 }, 0.9, 1000000, 31);
+	panel.write_sumstats(exp_file, { { 10, 0.3 } }, 32);
+	panel.write_sumstats(out_file, { { 10, 0.3 } }, 33);
+	phenotype *exposure = init_pheno(exp_file, "exp", 0, 0, 0, ""), *outcome = init_pheno(out_file, "out", 0, 0, 0, "");
+
+	// Without the flag, and with it given no priors
+	vector<coloc_prior> none, grid = { { 1e-4, 1e-4, 1e-5 }, { 1e-4, 1e-4, 1e-6 } };
+	run_coloc(exposure, outcome, dir.file("plain"), nullptr);
+	CHECK(fs::exists(dir.file("plain.coloc")));
+	CHECK(!fs::exists(dir.file("plain.coloc_grid")));
+
+	run_coloc(exposure, outcome, dir.file("empty"), &none);
+	CHECK(fs::exists(dir.file("empty.coloc")));
+	CHECK(!fs::exists(dir.file("empty.coloc_grid")));
+
+	run_coloc(exposure, outcome, dir.file("grid"), &grid);
+	CHECK(fs::exists(dir.file("grid.coloc_grid")));
+
+	delete(exposure);
+	delete(outcome);
+	if (test_failures > 0)
+		fprintf(stderr, "%d checks failed\n", test_failures);
+	return test_failures > 0;
+}
@@ -0,0 +1,79 @@
+#include "locus_ld.h"
+#include "test_utils.h"
+
+/*
+ * LD from the sketch must be within the standard error that is logged for it, pairs near
+ * the collinearity threshold must be recomputed exactly, and sketches reused by a later
+ * pair must give the same LD.
+ */
+int main()
+{
+	const size_t k = 256;
+	const double collinear = 0.5, bound = sqrt(2.0 / k);
+
+	spdlog::set_level(spdlog::level::warn);
+	test_dir dir("pwcoco_test_ld_sketch");
+	string prefix = dir.file("ref"), exp_file = dir.file("exp.txt"), out_file = dir.file("out.txt");
+
+	synth_panel panel(4000, { 40, 40 }, 0.95, 1000000, 21);
+	panel.write_plink(prefix);
+	panel.write_sumstats(exp_file, {}, 22);
+	panel.write_sumstats(out_file, {}, 23);
+
+	phenotype *exposure = init_pheno(exp_file, "exp", 0, 0, 0, ""), *outcome = init_pheno(out_file, "out", 0, 0, 0, "");
+	reference ref(dir.file("res"), 0);
+	CHECK(load_reference(&ref, prefix, exposure, outcome));
+
+	genotype_ld exact;
+	sketch_ld sketch(k, collinear);
+	sketch.begin_pair(&ref);
+
+	size_t m = ref.bim_snp_name.size(), pairs = 0, near = 0;
+	double sum_sq = 0.0, max_err = 0.0;
+	vector<double> var(m);
+	for (size_t r = 0; r < m; r++)
+		var[r] = exact.variance(&ref, r);
+	for (size_t r = 0; r < m; r++) {
+		vector<size_t> targets;
+		vector<double> cov_exact, cov_sketch;
+		for (size_t t = r + 1; t < m; t++)
+			targets.push_back(t);
+		exact.covariance(&ref, r, targets, cov_exact);
+		sketch.covariance(&ref, r, targets, cov_sketch);
+
+		for (size_t j = 0; j < targets.size(); j++) {
+			double sd = sqrt(var[r] * var[targets[j]]),
+				r_exact = cov_exact[j] / sd, r_sketch = cov_sketch[j] / sd;
+
+			if (r_exact * r_exact >= collinear) {
+				CHECK(cov_sketch[j] == cov_exact[j]);
+				near++;
+			}
+			else if (cov_sketch[j] != cov_exact[j]) {
+				sum_sq += (r_sketch - r_exact) * (r_sketch - r_exact);
+				max_err = max(max_err, fabs(r_sketch - r_exact));
+				pairs++;
+			}
+		}
+	}
+
+	// Sketches kept from the previous pair must give the same LD as fresh ones
+	vector<size_t> all(m - 1);
+	vector<double> before, after;
+	iota(all.begin(), all.end(), 1);
+	sketch.covariance(&ref, 0, all, before);
+	sketch.begin_pair(&ref);
+	sketch.covariance(&ref, 0, all, after);
+	CHECK(before == after);
+
+	CHECK(near > 0);
+	CHECK(pairs > 1000);
+	CHECK(sqrt(sum_sq / pairs) <= bound);
+	CHECK(max_err <= 5 * bound);
+
+	delete(exposure);
+	delete(outcome);
+	if (test_failures > 0)
+		fprintf(stderr, "%d checks failed\n", test_failures);
+	return test_failures > 0;
+}
@@ -0,0 +1,54 @@
+#include "conditional.h"
+#include "locus_ld.h"
+#include "test_utils.h"
+
+/*
+ * Stepwise selection run separately over independent LD blocks must select the same
+ * SNPs as a single pass over the whole region.
+ */
+static vector<string> select_snps(const string &sumstats, reference *ref, double top_snp, const string &out)
+{
+	phenotype *pheno = init_pheno(sumstats, "test", 0, 0, 0, "");
+	genotype_ld source;
+	locus_ld ld(&source);
+	conditional_dat cdat;
+	cond_analysis ca(5e-8, 0.9, 0.0, 1e5, out, top_snp, 0.2, "test", false, false);
+	vector<string> snps;
+
+	ld.begin_pair(ref);
+	ca.init_conditional(pheno, ref, &ld);
+	ca.find_independent_snps(&cdat, ref);
+	for (size_t i = 0; i < ca.get_num_ind(); i++)
+		snps.push_back(ca.get_ind_snp_name(i));
+	delete(pheno);
+	return snps;
+}
+
+int main()
+{
+	spdlog::set_level(spdlog::level::warn);
+	test_dir dir("pwcoco_test_stepwise_blocks");
+	string prefix = dir.file("ref"), exp_file = dir.file("exp.txt"), out_file = dir.file("out.txt");
+
+	// Four blocks 1Mb apart, with two signals in each of three of them
+	synth_panel panel(3000, { 60, 60, 60, 60 }, 0.9, 1000000, 11);
+	panel.write_plink(prefix);
+	panel.write_sumstats(exp_file, { { 10, 0.25 }, { 40, -0.2 }, { 75, 0.3 }, { 100, 0.2 }, { 190, -0.25 }, { 215, 0.2 } }, 12);
+	panel.write_sumstats(out_file, { { 20, 0.2 } }, 13);
+
+	phenotype *exposure = init_pheno(exp_file, "exp", 0, 0, 0, ""), *outcome = init_pheno(out_file, "out", 0, 0, 0, "");
+	reference ref(dir.file("res"), 0);
+	CHECK(load_reference(&ref, prefix, exposure, outcome));
+
+	// top_snp below the number of SNPs forces the single pass without capping the selection
+	vector<string> blocked = select_snps(exp_file, &ref, 1e10, dir.file("res")),
+		single = select_snps(exp_file, &ref, 100, dir.file("res"));
+	CHECK(blocked.size() >= 4);
+	CHECK(blocked == single);
+
+	delete(exposure);
+	delete(outcome);
+	if (test_failures > 0)
+		fprintf(stderr, "%d checks failed\n", test_failures);
+	return test_failures > 0;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "data.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+/*
+ * Small helpers shared by the tests: a minimal check macro and a synthetic PLINK
+ * reference with matching summary statistics, so that no test data has to be shipped.
+ */
+static int test_failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+/*
+ * Scratch directory under the system temporary directory, removed on destruction.
+ */
+struct test_dir {
+	fs::path path;
+
+	test_dir(const string &name) {
+		path = fs::temp_directory_path() / (name + "." + to_string(getpid()));
+		fs::remove_all(path);
+		fs::create_directories(path);
+	}
+	~test_dir() {
+		error_code ec;
+		fs::remove_all(path, ec);
+	}
+
+	string file(const string &name) const {
+		return (path / name).string();
+	}
+};
+
+/*
+ * Synthetic genotypes: blocks of SNPs on chromosome 1 whose haplotypes follow a latent
+ * AR(1) process with correlation rho along the block, so neighbouring SNPs are in LD.
+ * Blocks are block_gap bp apart and SNPs within a block 1kb apart.
+ */
+struct synth_panel {
+	vector<string> snp, a1, a2;
+	vector<int> bp;
+	vector<vector<int>> dosage; /// Copies of A1 for each SNP and individual; -1 if missing
+
+	synth_panel(size_t n_ind, const vector<size_t> &block_sizes, double rho, int block_gap, unsigned seed) {
+		mt19937_64 rng(seed);
+		normal_distribution<double> norm(0.0, 1.0);
+		uniform_real_distribution<double> unif(0.05, 0.5);
+		const char *alleles[4] = { "A", "C", "G", "T" };
+		vector<double> lat(2 * n_ind);
+
+		for (size_t b = 0; b < block_sizes.size(); b++) {
+			for (size_t s = 0; s < block_sizes[b]; s++) {
+				for (auto &x : lat)
+					x = s == 0 ? norm(rng) : rho * x + sqrt(1 - rho * rho) * norm(rng);
+
+				// Threshold the latent normal at the A1 frequency
+				double f = unif(rng), thr = 0.0, lo = -10.0, hi = 10.0;
+				for (int it = 0; it < 100; it++) {
+					thr = (lo + hi) / 2;
+					(0.5 * erfc(-thr / sqrt(2.0)) < f ? lo : hi) = thr;
+				}
+
+				size_t j = snp.size();
+				snp.push_back("rs" + to_string(1000 + j));
+				a1.push_back(alleles[j % 4]);
+				a2.push_back(alleles[(j + 1) % 4]);
+				bp.push_back(1000000 + (int)b * block_gap + (int)s * 1000);
+				dosage.push_back(vector<int>(n_ind));
+				for (size_t i = 0; i < n_ind; i++)
+					dosage[j][i] = (lat[2 * i] < thr) + (lat[2 * i + 1] < thr);
+			}
+		}
+	}
+
+	void write_plink(const string &prefix) const {
+		size_t n = dosage.empty() ? 0 : dosage[0].size(), j = 0, i = 0;
+		ofstream bim(prefix + ".bim"), fam(prefix + ".fam");
+		ofstream bed(prefix + ".bed", ios::binary);
+
+		for (i = 0; i < n; i++)
+			fam << "F" << i << " I" << i << " 0 0 1 -9\n";
+
+		const char magic[3] = { 0x6c, 0x1b, 0x01 };
+		bed.write(magic, 3);
+		for (j = 0; j < snp.size(); j++) {
+			bim << "1\t" << snp[j] << "\t0\t" << bp[j] << "\t" << a1[j] << "\t" << a2[j] << "\n";
+			vector<char> row((n + 3) / 4, 0);
+			for (i = 0; i < n; i++) {
+				int code = dosage[j][i] == 2 ? 0 : dosage[j][i] == 1 ? 2 : dosage[j][i] == 0 ? 3 : 1;
+				row[i / 4] |= (char)(code << (2 * (i % 4)));
+			}
+			bed.write(row.data(), row.size());
+		}
+	}
+
+	/*
+	 * Marginal regressions of y = sum(effect * dosage) + noise on each SNP, written
+	 * as summary statistics for the A1 allele.
+	 */
+	void write_sumstats(const string &file, const vector<pair<size_t, double>> &effects, unsigned seed) const {
+		size_t n = dosage[0].size(), j = 0, i = 0;
+		mt19937_64 rng(seed);
+		normal_distribution<double> norm(0.0, 1.0);
+		vector<double> y(n);
+		ofstream out(file);
+
+		for (i = 0; i < n; i++)
+			y[i] = norm(rng);
+		for (auto &e : effects) {
+			for (i = 0; i < n; i++)
+				y[i] += e.second * dosage[e.first][i];
+		}
+
+		out << "SNP\tA1\tA2\tfreq\tb\tse\tp\tN\n";
+		for (j = 0; j < snp.size(); j++) {
+			double sg = 0, sy = 0, sgg = 0, sgy = 0, syy = 0;
+			for (i = 0; i < n; i++) {
+				sg += dosage[j][i];
+				sy += y[i];
+				sgg += (double)dosage[j][i] * dosage[j][i];
+				sgy += dosage[j][i] * y[i];
+				syy += y[i] * y[i];
+			}
+			double vg = sgg / n - sg * sg / n / n, vy = syy / n - sy * sy / n / n,
+				b = (sgy / n - sg * sy / n / n) / vg,
+				se = sqrt((vy - b * b * vg) / ((n - 2) * vg)),
+				p = erfc(fabs(b / se) / sqrt(2.0));
+			out << snp[j] << "\t" << a1[j] << "\t" << a2[j] << "\t" << sg / (2.0 * n) << "\t" << b << "\t" << se << "\t" << p << "\t" << n << "\n";
+		}
+	}
+};
+
+/*
+ * Reads the reference for one pair of summary statistics as the command line does
+ * for files.
+ */
+static bool load_reference(reference *ref, const string &prefix, phenotype *exposure, phenotype *outcome)
+{
+	if (ref->read_bimfile(prefix + ".bim") == 0)
+		return false;
+	ref->match_bim(exposure->get_snp_names(), outcome->get_snp_names(), false);
+	ref->sanitise_list();
+	return ref->read_famfile(prefix + ".fam") != 0 && ref->read_bedfile(prefix + ".bed") != 0;
+}